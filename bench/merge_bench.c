@@ -0,0 +1,175 @@
+/*
+ * This file is released under the GPL.
+ *
+ * writeset merge microbenchmark: chunks per second of every
+ * merge kernel supported by the cpu, when 1, 16 and 256
+ * writesets are merged into one window of eras; kernels are
+ * built with -O2 and linked as in erasetup
+ *
+ * make bench
+ */
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../era_merge.h"
+
+// chunks per window, as in the snapshot copy
+#define BENCH_CHUNKS (1024 * 1024)
+#define BENCH_WORDS (BENCH_CHUNKS / 64)
+
+// minimal time to measure one kernel, seconds
+#define BENCH_TIME 0.05
+
+// kernels are measured in turn this many times, the best is kept
+#define BENCH_REPEAT 8
+
+// kernels measured at most
+#define BENCH_KERNELS 8
+
+static const unsigned bench_writesets[] = { 1, 16, 256 };
+
+#define BENCH_RUNS (sizeof(bench_writesets) / sizeof(bench_writesets[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fill words so that about one bit in 1 << shift is set,
+ * shift 0 sets every bit
+ */
+static void bench_fill(uint64_t *words, unsigned count, unsigned shift,
+                       uint64_t *x)
+{
+	unsigned i, k;
+	uint64_t w;
+
+	for (i = 0; i < count; i++)
+	{
+		w = ~0ULL;
+
+		for (k = 0; k < shift; k++)
+		{
+			*x = *x * 6364136223846793005ULL +
+			     1442695040888963407ULL;
+			w &= *x >> 7;
+		}
+
+		words[i] = w;
+	}
+}
+
+/*
+ * merge all writesets into the window, oldest first, until
+ * BENCH_TIME has passed; returns chunks per second
+ */
+static double bench_run(mergefn_t merge, uint32_t *eras,
+                        const uint64_t *words, unsigned writesets)
+{
+	unsigned i, rounds = 0;
+	double start, elapsed;
+
+	start = now();
+
+	do
+	{
+		memset(eras, 0, sizeof(uint32_t) * BENCH_CHUNKS);
+
+		for (i = 0; i < writesets; i++)
+			merge(eras, words + (size_t)i * BENCH_WORDS,
+			         BENCH_WORDS, i + 1);
+
+		rounds++;
+		elapsed = now() - start;
+	}
+	while (elapsed < BENCH_TIME);
+
+	return (double)BENCH_CHUNKS * rounds / elapsed;
+}
+
+int main(void)
+{
+	static const struct {
+		const char *name;
+		unsigned shift;
+	} densities[] = {
+		{ "dense",  1 },          /* 1/2 of bits set */
+		{ "medium", 3 },          /* 1/8 of bits set */
+		{ "sparse", 6 },          /* 1/64 of bits set */
+	};
+	unsigned max_writesets = bench_writesets[BENCH_RUNS - 1];
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	size_t words_size, eras_size;
+	const char *names[BENCH_KERNELS], *name;
+	mergefn_t merges[BENCH_KERNELS], merge;
+	double best[BENCH_KERNELS], rate;
+	unsigned d, n, i, r, count = 0;
+	uint64_t *words;
+	uint32_t *eras;
+
+	words_size = sizeof(uint64_t) * BENCH_WORDS * max_writesets;
+	eras_size = sizeof(uint32_t) * BENCH_CHUNKS;
+
+	words = mmap(NULL, words_size, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	eras = mmap(NULL, eras_size, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (words == MAP_FAILED || eras == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+
+	for (i = 0; count < BENCH_KERNELS &&
+	            (name = era_merge_kernel(i, &merge)); i++)
+	{
+		if (!merge)
+			continue;
+
+		names[count] = name;
+		merges[count++] = merge;
+	}
+
+	printf("%-8s %-8s %9s %14s\n",
+	       "kernel", "words", "writesets", "chunks/s");
+
+	for (d = 0; d < sizeof(densities) / sizeof(densities[0]); d++)
+	{
+		bench_fill(words, BENCH_WORDS * max_writesets,
+		           densities[d].shift, &x);
+
+		for (n = 0; n < BENCH_RUNS; n++)
+		{
+			memset(best, 0, sizeof(best));
+
+			// in turn, so no kernel is favoured by running first
+			for (r = 0; r < BENCH_REPEAT; r++)
+			{
+				for (i = 0; i < count; i++)
+				{
+					rate = bench_run(merges[i], eras, words,
+					                 bench_writesets[n]);
+					if (rate > best[i])
+						best[i] = rate;
+				}
+			}
+
+			for (i = 0; i < count; i++)
+				printf("%-8s %-8s %9u %14.0f\n",
+				       names[i], densities[d].name,
+				       bench_writesets[n], best[i]);
+		}
+	}
+
+	munmap(words, words_size);
+	munmap(eras, eras_size);
+	return 0;
+}
@@ -34,3 +34,60 @@ static inline int test_and_set_bit(unsigned long nr, unsigned long *bitmap)
 	bitmap[offset] |= 1UL << bit;
 	return rc;
 }
+
+static inline int test_and_set_bit_atomic(unsigned long nr,
+                                          unsigned long *bitmap)
+{
+	unsigned long offset = nr / BITS_PER_LONG;
+	unsigned long mask = 1UL << (nr & (BITS_PER_LONG - 1));
+	return (__atomic_fetch_or(&bitmap[offset], mask,
+	                          __ATOMIC_RELAXED) & mask) != 0;
+}
+
+// first set bit at or after nr, size if there is none
+static inline unsigned long find_next_bit(const unsigned long *bitmap,
+                                          unsigned long size,
+                                          unsigned long nr)
+{
+	unsigned long offset, word;
+
+	if (nr >= size)
+		return size;
+
+	offset = nr / BITS_PER_LONG;
+	word = bitmap[offset] & (~0UL << (nr & (BITS_PER_LONG - 1)));
+
+	while (!word)
+	{
+		if (++offset >= LONGS(size))
+			return size;
+		word = bitmap[offset];
+	}
+
+	nr = offset * BITS_PER_LONG + __builtin_ctzl(word);
+	return nr < size ? nr : size;
+}
+
+// first clear bit at or after nr, size if there is none
+static inline unsigned long find_next_zero_bit(const unsigned long *bitmap,
+                                               unsigned long size,
+                                               unsigned long nr)
+{
+	unsigned long offset, word;
+
+	if (nr >= size)
+		return size;
+
+	offset = nr / BITS_PER_LONG;
+	word = ~bitmap[offset] & (~0UL << (nr & (BITS_PER_LONG - 1)));
+
+	while (!word)
+	{
+		if (++offset >= LONGS(size))
+			return size;
+		word = ~bitmap[offset];
+	}
+
+	nr = offset * BITS_PER_LONG + __builtin_ctzl(word);
+	return nr < size ? nr : size;
+}
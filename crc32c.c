@@ -12,10 +12,23 @@
  *    XorOut       = 0xffffffff
  *    ReflectOut   = True
  *    Algorithm    = table-driven
+ *
+ * The generated byte-at-a-time loop is kept as the reference implementation.
+ * crc_update() dispatches to the fastest engine available on the running CPU
+ * (SSE4.2 crc32 instruction or portable slicing-by-8), selected once
+ * (pthread_once) on the first call after checking it against the reference.
  *****************************************************************************/
 #include "crc32c.h"     /* include the header file generated with pycrc */
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#include "era_kernel.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC_HAVE_SSE42 1
+#endif
 
 /**
  * Static table used for the table_driven implementation.
@@ -109,14 +122,9 @@ crc_t crc_reflect(crc_t data, size_t data_len)
 
 
 /**
- * Update the crc value with new data.
- *
- * \param crc      The current crc value.
- * \param data     Pointer to a buffer of \a data_len bytes.
- * \param data_len Number of bytes in the \a data buffer.
- * \return         The updated crc value.
+ * Reference table-driven implementation (pycrc).
  *****************************************************************************/
-crc_t crc_update(crc_t crc, const void *data, size_t data_len)
+static crc_t crc_update_table(crc_t crc, const void *data, size_t data_len)
 {
     const unsigned char *d = (const unsigned char *)data;
     unsigned int tbl_idx;
@@ -131,3 +139,383 @@ crc_t crc_update(crc_t crc, const void *data, size_t data_len)
 }
 
 
+/**
+ * Tables for the slicing-by-8 implementation,
+ * derived from crc_table by crc_engine_setup().
+ *****************************************************************************/
+static uint32_t crc_table8[8][256];
+
+
+/**
+ * Portable slicing-by-8 implementation: eight table lookups per 8 bytes.
+ *****************************************************************************/
+static crc_t crc_update_slice8(crc_t crc, const void *data, size_t data_len)
+{
+    const unsigned char *d = (const unsigned char *)data;
+    uint32_t c = (uint32_t)crc;
+
+    while (data_len && ((uintptr_t)d & 7)) {
+        c = crc_table8[0][(c ^ *d++) & 0xff] ^ (c >> 8);
+        data_len--;
+    }
+
+    while (data_len >= 8) {
+        c ^= (uint32_t)d[0] | (uint32_t)d[1] << 8 |
+             (uint32_t)d[2] << 16 | (uint32_t)d[3] << 24;
+        c = crc_table8[7][c & 0xff] ^
+            crc_table8[6][(c >> 8) & 0xff] ^
+            crc_table8[5][(c >> 16) & 0xff] ^
+            crc_table8[4][c >> 24] ^
+            crc_table8[3][d[4]] ^
+            crc_table8[2][d[5]] ^
+            crc_table8[1][d[6]] ^
+            crc_table8[0][d[7]];
+        d += 8;
+        data_len -= 8;
+    }
+
+    while (data_len--)
+        c = crc_table8[0][(c ^ *d++) & 0xff] ^ (c >> 8);
+
+    return c;
+}
+
+
+#ifdef CRC_HAVE_SSE42
+
+/**
+ * Length of each of the three interleaved streams; three lanes cover
+ * a whole metadata block checksum area (4092 bytes) in one round.
+ *****************************************************************************/
+#define CRC_LANE 1360
+
+
+/**
+ * x^(8 * CRC_LANE) mod P in the reflected domain,
+ * used to shift a lane crc over the following lane.
+ *****************************************************************************/
+static uint32_t crc_lane_shift;
+
+
+/**
+ * Multiply a and b modulo the (reflected) crc32c polynomial.
+ *****************************************************************************/
+static uint32_t crc_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82f63b78 : b >> 1;
+    }
+    return p;
+}
+
+
+/**
+ * Calculate x^(8 * n) mod P in the reflected domain.
+ *****************************************************************************/
+static uint32_t crc_x8nmodp(size_t n)
+{
+    uint32_t p = (uint32_t)1 << 31;         /* x^0 */
+    uint32_t x = (uint32_t)1 << 30;         /* x^1 */
+    size_t k = n * 8;
+
+    while (k) {
+        if (k & 1)
+            p = crc_multmodp(x, p);
+        x = crc_multmodp(x, x);
+        k >>= 1;
+    }
+    return p;
+}
+
+
+/**
+ * SSE4.2 implementation: three independent crc32 streams hide the
+ * three cycle latency of the instruction, the lane crcs are then
+ * combined by a carry-less shift.
+ *****************************************************************************/
+__attribute__ ((target("sse4.2")))
+static crc_t crc_update_sse42(crc_t crc, const void *data, size_t data_len)
+{
+    const unsigned char *d = (const unsigned char *)data;
+    uint64_t c0 = (uint32_t)crc;
+
+    while (data_len && ((uintptr_t)d & 7)) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *d++);
+        data_len--;
+    }
+
+    while (data_len >= 3 * CRC_LANE) {
+        const unsigned char *end = d + CRC_LANE;
+        uint64_t c1 = 0, c2 = 0;
+
+        do {
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *)d);
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *)(d + CRC_LANE));
+            c2 = _mm_crc32_u64(c2,
+                               *(const uint64_t *)(d + 2 * CRC_LANE));
+            d += 8;
+        } while (d < end);
+
+        c0 = crc_multmodp(crc_lane_shift, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = crc_multmodp(crc_lane_shift, (uint32_t)c0) ^ (uint32_t)c2;
+
+        d += 2 * CRC_LANE;
+        data_len -= 3 * CRC_LANE;
+    }
+
+    while (data_len >= 8) {
+        c0 = _mm_crc32_u64(c0, *(const uint64_t *)d);
+        d += 8;
+        data_len -= 8;
+    }
+
+    while (data_len--)
+        c0 = _mm_crc32_u8((uint32_t)c0, *d++);
+
+    return (uint32_t)c0;
+}
+
+
+/**
+ * SSE4.2 implementation for several buffers of the same length:
+ * three buffers are processed at once, one crc32 stream each.
+ *****************************************************************************/
+__attribute__ ((target("sse4.2")))
+static void crc_update_many_sse42(crc_t *crc, const void *const *data,
+                                  size_t data_len, unsigned int count)
+{
+    unsigned int i = 0;
+
+    for (; i + 3 <= count; i += 3) {
+        const unsigned char *d0 = data[i];
+        const unsigned char *d1 = data[i + 1];
+        const unsigned char *d2 = data[i + 2];
+        uint64_t c0 = (uint32_t)crc[i];
+        uint64_t c1 = (uint32_t)crc[i + 1];
+        uint64_t c2 = (uint32_t)crc[i + 2];
+        size_t n = data_len;
+
+        while (n >= 8) {
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *)d0);
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *)d1);
+            c2 = _mm_crc32_u64(c2, *(const uint64_t *)d2);
+            d0 += 8;
+            d1 += 8;
+            d2 += 8;
+            n -= 8;
+        }
+
+        while (n--) {
+            c0 = _mm_crc32_u8((uint32_t)c0, *d0++);
+            c1 = _mm_crc32_u8((uint32_t)c1, *d1++);
+            c2 = _mm_crc32_u8((uint32_t)c2, *d2++);
+        }
+
+        crc[i] = (uint32_t)c0;
+        crc[i + 1] = (uint32_t)c1;
+        crc[i + 2] = (uint32_t)c2;
+    }
+
+    for (; i < count; i++)
+        crc[i] = crc_update_sse42(crc[i], data[i], data_len);
+}
+
+#endif
+
+
+/**
+ * Available engines, the best one first.
+ *****************************************************************************/
+struct crc_engine {
+    struct era_kernel kernel;
+    crc_t (*update)(crc_t crc, const void *data, size_t data_len);
+    void (*update_many)(crc_t *crc, const void *const *data,
+                        size_t data_len, unsigned int count);
+};
+
+static void crc_update_many_slice8(crc_t *crc, const void *const *data,
+                                   size_t data_len, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        crc[i] = crc_update_slice8(crc[i], data[i], data_len);
+}
+
+static void crc_update_many_table(crc_t *crc, const void *const *data,
+                                  size_t data_len, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        crc[i] = crc_update_table(crc[i], data[i], data_len);
+}
+
+static int crc_always(void)
+{
+    return 1;
+}
+
+#ifdef CRC_HAVE_SSE42
+static int crc_have_sse42(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+static const struct crc_engine crc_engines[] = {
+#ifdef CRC_HAVE_SSE42
+    { { "sse4.2",     crc_have_sse42 },
+      crc_update_sse42,  crc_update_many_sse42 },
+#endif
+    { { "slice-by-8", crc_always },
+      crc_update_slice8, crc_update_many_slice8 },
+    { { "table",      crc_always },
+      crc_update_table,  crc_update_many_table },
+};
+
+#define CRC_ENGINES (sizeof(crc_engines) / sizeof(crc_engines[0]))
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static const struct crc_engine *crc_selected;
+
+
+/**
+ * Build derived tables and constants.
+ *****************************************************************************/
+static void crc_engine_setup(void)
+{
+    unsigned int i, k;
+
+    for (i = 0; i < 256; i++)
+        crc_table8[0][i] = (uint32_t)crc_table[i];
+
+    for (k = 1; k < 8; k++)
+        for (i = 0; i < 256; i++)
+            crc_table8[k][i] = (crc_table8[k - 1][i] >> 8) ^
+                               crc_table8[0][crc_table8[k - 1][i] & 0xff];
+
+#ifdef CRC_HAVE_SSE42
+    crc_lane_shift = crc_x8nmodp(CRC_LANE);
+#endif
+}
+
+
+/**
+ * Check one engine against the reference implementation using
+ * every length up to 64 bytes at every alignment, and a few
+ * lengths around the interleaving thresholds.
+ *****************************************************************************/
+static int crc_engine_check(const void *kernel)
+{
+    static const size_t lengths[] = {
+        4092, 4096, 4080, 4079, 4081, 8192, 3 * 1360 - 1, 12288 + 5
+    };
+    const struct crc_engine *e = kernel;
+    unsigned char buf[12288 + 16];
+    const void *many[7];
+    crc_t crcs[7];
+    crc_t init;
+    size_t i, off, len;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (unsigned char)((i * 2654435761u) >> 13);
+
+    for (off = 0; off < 8; off++)
+        for (len = 0; len <= 64; len++) {
+            init = (crc_init() ^ (crc_t)(len * 0x9e3779b9u)) & 0xffffffff;
+            if (e->update(init, buf + off, len) !=
+                crc_update_table(init, buf + off, len))
+                return -1;
+        }
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+        for (off = 0; off < 4; off++) {
+            len = lengths[i];
+            if (e->update(crc_init(), buf + off, len) !=
+                crc_update_table(crc_init(), buf + off, len))
+                return -1;
+        }
+
+    for (len = 4092; len <= 4096; len++) {
+        for (i = 0; i < 7; i++) {
+            many[i] = buf + i * 1024 + (i & 3);
+            crcs[i] = crc_init() ^ i;
+        }
+
+        e->update_many(crcs, many, len, 7);
+
+        for (i = 0; i < 7; i++)
+            if (crcs[i] != crc_update_table(crc_init() ^ i, many[i], len))
+                return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Select the best supported engine that passes the self-test;
+ * runs once, before the first checksum of any thread.
+ *****************************************************************************/
+static void crc_engine_select(void)
+{
+    crc_engine_setup();
+    crc_selected = era_kernel_select(crc_engines, sizeof(crc_engines[0]),
+                                     CRC_ENGINES, crc_engine_check);
+}
+
+
+/**
+ * Name of the engine used by crc_update().
+ *
+ * \return     The engine name.
+ *****************************************************************************/
+const char *crc_engine(void)
+{
+    pthread_once(&crc_once, crc_engine_select);
+    return crc_selected->kernel.name;
+}
+
+
+/**
+ * Update the crc value with new data.
+ *
+ * \param crc      The current crc value.
+ * \param data     Pointer to a buffer of \a data_len bytes.
+ * \param data_len Number of bytes in the \a data buffer.
+ * \return         The updated crc value.
+ *****************************************************************************/
+crc_t crc_update(crc_t crc, const void *data, size_t data_len)
+{
+    pthread_once(&crc_once, crc_engine_select);
+    return crc_selected->update(crc, data, data_len);
+}
+
+
+/**
+ * Update several crc values, each with its own buffer of the same length.
+ * The buffers are checksummed in an interleaved fashion when the selected
+ * engine supports it.
+ *
+ * \param crc      Array of \a count current crc values, updated in place.
+ * \param data     Array of \a count pointers to buffers of \a data_len bytes.
+ * \param data_len Number of bytes in each buffer.
+ * \param count    Number of buffers.
+ *****************************************************************************/
+void crc_update_many(crc_t *crc, const void *const *data,
+                     size_t data_len, unsigned int count)
+{
+    pthread_once(&crc_once, crc_engine_select);
+    crc_selected->update_many(crc, data, data_len, count);
+}
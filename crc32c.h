@@ -73,6 +73,26 @@ static inline crc_t crc_init(void)
 crc_t crc_update(crc_t crc, const void *data, size_t data_len);
 
 
+/**
+ * Update several crc values, each with its own buffer of the same length.
+ *
+ * \param crc      Array of \a count current crc values, updated in place.
+ * \param data     Array of \a count pointers to buffers of \a data_len bytes.
+ * \param data_len Number of bytes in each buffer.
+ * \param count    Number of buffers.
+ *****************************************************************************/
+void crc_update_many(crc_t *crc, const void *const *data,
+                     size_t data_len, unsigned int count);
+
+
+/**
+ * Name of the crc engine selected for crc_update().
+ *
+ * \return     The engine name ("sse4.2", "slice-by-8" or "table").
+ *****************************************************************************/
+const char *crc_engine(void);
+
+
 /**
  * Calculate the final crc value.
  *
@@ -28,9 +28,20 @@ extern void *empty_block;
 // global options
 extern int verbose;
 extern int force;
+extern int jobs;
+extern int max_suspend_ms;
+extern int stats;
+extern int verify_leaves;
+
+// stats output formats
+#define STATS_JSON 1
+
+#define RANDOM_DEVICE "/dev/urandom"
 
 // global functions
 char *uuid2str(const void *uuid);
+int random_uuid(void *uuid);
+double now_ms(void);
 void usage(FILE *out, int code);
 void error(int err, const char *fmt, ...)
 	__attribute__ ((format (printf, 2, 3)));
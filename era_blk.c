@@ -265,3 +265,35 @@ notfound:
 	error(0, "can't find device %u:%u", major, minor);
 	return -1;
 }
+
+/*
+ * 1 if device is rotational, 0 if not or unknown;
+ * partitions have no queue, their parent disk is checked
+ */
+int blkrotational(unsigned major, unsigned minor)
+{
+	static const char *templates[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational",
+	};
+	char path[PATH_MAX];
+	unsigned i;
+	FILE *f;
+	int c;
+
+	for (i = 0; i < sizeof(templates) / sizeof(templates[0]); i++)
+	{
+		snprintf(path, sizeof(path), templates[i], major, minor);
+
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+
+		c = fgetc(f);
+		fclose(f);
+
+		return c == '1';
+	}
+
+	return 0;
+}
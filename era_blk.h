@@ -13,4 +13,6 @@ int blkopen(const char *device, int rw,
 
 int blkopen2(unsigned major, unsigned minor, int rw, uint64_t *sectors);
 
+int blkrotational(unsigned major, unsigned minor);
+
 #endif
@@ -4,35 +4,70 @@
 
 #define _GNU_SOURCE
 
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <endian.h>
+#include <errno.h>
 
 #include "era.h"
 #include "era_md.h"
 #include "era_btree.h"
 
 /*
- * visit btree array node
+ * walk parameters: leaf type and callbacks
+ *
+ * datacb is called by sequential walks in key order,
+ * leafcb by parallel walks with leaf position
+ */
+struct walk_ctx {
+	enum leaf_type type;
+	datacb_t datacb;
+	void *dataarg;
+	leafcb_t leafcb;
+	void *leafarg;
+	blockcb_t blockcb;
+	void *blockarg;
+	struct scan_list *scan;      /* collect array blocks, don't read */
+	arraycb_t arraycb;           /* metadata walk: every array block */
+	void *arrayarg;
+	int follow;                  /* walk bitsets of writesets leaves */
+	int skip_arrays;             /* pass array blocks unread */
+};
+
+/*
+ * array block references collected by elevator scan
+ */
+struct scan_entry {
+	uint64_t nr;                 /* array block number */
+	uint64_t key;                /* array block index */
+	enum leaf_type type;         /* btree of the block */
+};
+
+struct scan_list {
+	pthread_mutex_t lock;        /* parallel walk adds at once */
+	struct scan_entry *entries;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * check btree array node
  *
  * leaf_type:
  *   LEAF_ARRAY:  leaf contains era_array elemens
  *   LEAF_BITSET: leaf contains bitset elements
  */
-static int walk_array_node(struct md *md, uint64_t nr, enum leaf_type type,
-                           datacb_t datacb, void *dataarg,
-                           blockcb_t blockcb, void *blockarg)
+static int check_array_node(struct array_node *node, uint64_t nr,
+                            enum leaf_type type)
 {
-	struct array_node *node;
 	uint64_t blocknr;
 	unsigned nr_entries;
 	unsigned max_entries;
 	unsigned value_size;
-	unsigned expected;
-	int rc = 0;
-
-	node = md_block(md, 0, nr, ARRAY_CSUM_XOR);
-	if (!node)
-		return -1;
+	unsigned expected = 0;
 
 	blocknr = le64toh(node->header.blocknr);
 	if (blocknr != nr)
@@ -83,32 +118,141 @@ static int walk_array_node(struct md *md, uint64_t nr, enum leaf_type type,
 		return -1;
 	}
 
-	if (blockcb && blockcb(blockarg, nr, node))
+	return 0;
+}
+
+/*
+ * visit btree array node
+ */
+static int walk_array_node(struct array_node *node, uint64_t nr,
+                           uint64_t key, enum leaf_type type,
+                           struct walk_ctx *ctx)
+{
+	unsigned nr_entries;
+	unsigned max_entries;
+	int rc = 0;
+
+	if (check_array_node(node, nr, type))
 		return -1;
 
-	if (nr_entries && datacb)
-		rc = datacb(dataarg, nr_entries, NULL, node->values);
+	max_entries = le32toh(node->header.max_entries);
+	nr_entries = le32toh(node->header.nr_entries);
+
+	if (ctx->blockcb && ctx->blockcb(ctx->blockarg, nr, node))
+		return -1;
+
+	// metadata walk: leafcb is for writesets leaves only
+	if (ctx->arraycb)
+		return ctx->arraycb(ctx->arrayarg, type, key, node) ? -1 : 0;
+
+	if (nr_entries && ctx->datacb)
+		rc = ctx->datacb(ctx->dataarg, nr_entries, NULL, node->values);
+
+	// array block key is its index in the array
+	if (nr_entries && ctx->leafcb)
+		rc = ctx->leafcb(ctx->leafarg, key * max_entries,
+		                 nr_entries, NULL, node->values);
 
 	return rc ? -1 : 0;
 }
 
 /*
- * visit btree node
+ * read all array nodes referenced by btree leaf at once
+ * and visit them in order
+ */
+static int walk_array_nodes(struct md *md, const __le64 *keys,
+                            const __le64 *values, unsigned count,
+                            enum leaf_type type, struct walk_ctx *ctx)
+{
+	struct md_csum csums[MD_BATCH_BLOCKS];
+	uint64_t blocks[MD_BATCH_BLOCKS];
+	unsigned i, n, valid;
+
+	while (count)
+	{
+		n = count > MD_BATCH_BLOCKS ? MD_BATCH_BLOCKS : count;
+
+		for (i = 0; i < n; i++)
+		{
+			blocks[i] = le64toh(values[i]);
+			csums[i].block = md->batch + MD_BLOCK_SIZE * i;
+			csums[i].xor = ARRAY_CSUM_XOR;
+		}
+
+		if (md_read_many(md, blocks, n, md->batch))
+			return -1;
+
+		valid = md_csum_verify_many(csums, n);
+		if (valid != n)
+		{
+			error(0, "bad block checksum: %llu",
+			         (long long unsigned)blocks[valid]);
+			return -1;
+		}
+
+		for (i = 0; i < n; i++)
+			if (walk_array_node(csums[i].block, blocks[i],
+			                    le64toh(keys[i]), type, ctx) == -1)
+				return -1;
+
+		keys += n;
+		values += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * pass array nodes referenced by btree leaf without reading them
+ */
+static int skip_array_nodes(struct md *md, const __le64 *keys,
+                            const __le64 *values, unsigned count,
+                            enum leaf_type type, struct walk_ctx *ctx)
+{
+	uint64_t nr;
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+	{
+		nr = le64toh(values[i]);
+
+		// not read, so md_block can't check it
+		if (nr >= md->blocks)
+		{
+			error(0, "array block %llu is beyond metadata "
+			         "device (%llu blocks)",
+			         (long long unsigned)nr,
+			         (long long unsigned)md->blocks);
+			return -1;
+		}
+
+		if (ctx->blockcb && ctx->blockcb(ctx->blockarg, nr, NULL))
+			return -1;
+
+		if (ctx->arraycb && ctx->arraycb(ctx->arrayarg, type,
+		                                 le64toh(keys[i]), NULL))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * read, pin and check btree node
  */
-static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
-                           datacb_t datacb, void *dataarg,
-                           blockcb_t blockcb, void *blockarg)
+static struct btree_node *get_btree_node(struct md *md, uint64_t nr,
+                                         enum leaf_type type)
 {
 	uint64_t blocknr;
-	unsigned i, flags;
-	unsigned value_size, expected;
+	unsigned flags;
+	unsigned value_size, expected = 0;
 	unsigned nr_entries, max_entries;
 	struct btree_node *node;
-	int rc = 0;
 
-	node = md_block(md, MD_CACHED, nr, BTREE_CSUM_XOR);
+	node = md_block(md, MD_CACHED | MD_PIN, nr, BTREE_CSUM_XOR);
 	if (!node)
-		return -1;
+		return NULL;
 
 	blocknr = le64toh(node->header.blocknr);
 	if (blocknr != nr)
@@ -117,7 +261,7 @@ static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
 		         "expected %llu, but got: %llu",
 		         (long long unsigned)nr,
 		         (long long unsigned)blocknr);
-		return -1;
+		goto out;
 	}
 
 	flags = le32toh(node->header.flags);
@@ -125,7 +269,7 @@ static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
 	{
 		error(0, "bad btree node: both internnal and leaf "
 		         "bits are set");
-		return -1;
+		goto out;
 	}
 
 	value_size = le32toh(node->header.value_size);
@@ -154,7 +298,7 @@ static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
 		error(0, "bad btree node: value_size mismatch: "
 		         "expected %u, but got %u",
 		         expected, value_size);
-		return -1;
+		goto out;
 	}
 
 	max_entries = le32toh(node->header.max_entries);
@@ -163,14 +307,14 @@ static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
 	{
 		error(0, "bad btree node: max_entries too large: %u",
 		         max_entries);
-		return -1;
+		goto out;
 	}
 
 	if (max_entries % 3)
 	{
 		error(0, "bad btree node: max entries is not divisible "
 		         "by 3: %u", max_entries);
-		return -1;
+		goto out;
 	}
 
 	nr_entries = le32toh(node->header.nr_entries);
@@ -178,100 +322,1249 @@ static int walk_btree_node(struct md *md, uint64_t nr, enum leaf_type type,
 	{
 		error(0, "bad btree node: nr_entries (%u) > "
 		         "max_entries (%u)", nr_entries, max_entries);
-		return -1;
+		goto out;
+	}
+
+	return node;
+out:
+	md_unpin(md, node);
+	return NULL;
+}
+
+// remember array blocks of btree leaf
+static int scan_collect(struct scan_list *list, const __le64 *keys,
+                        const __le64 *values, unsigned count,
+                        enum leaf_type type)
+{
+	struct scan_entry *p;
+	unsigned i;
+
+	pthread_mutex_lock(&list->lock);
+
+	if (list->count + count > list->size)
+	{
+		size_t size = list->size ? list->size : 1024;
+
+		while (size < list->count + count)
+			size <<= 1;
+
+		p = realloc(list->entries, sizeof(struct scan_entry) * size);
+		if (!p)
+		{
+			pthread_mutex_unlock(&list->lock);
+			error(ENOMEM, NULL);
+			return -1;
+		}
+
+		list->entries = p;
+		list->size = size;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		list->entries[list->count].nr = le64toh(values[i]);
+		list->entries[list->count].key = le64toh(keys[i]);
+		list->entries[list->count].type = type;
+		list->count++;
+	}
+
+	pthread_mutex_unlock(&list->lock);
+	return 0;
+}
+
+/*
+ * visit btree leaf
+ */
+static int walk_btree_leaf(struct md *md, struct btree_node *node,
+                           enum leaf_type type, struct walk_ctx *ctx)
+{
+	unsigned max_entries = le32toh(node->header.max_entries);
+	unsigned nr_entries = le32toh(node->header.nr_entries);
+	void *values = &node->keys[max_entries];
+	void *keys = &node->keys[0];
+
+	if (type == LEAF_ARRAY || type == LEAF_BITSET)
+	{
+		if (ctx->scan)
+			return scan_collect(ctx->scan, keys, values,
+			                    nr_entries, type);
+
+		if (ctx->skip_arrays)
+			return skip_array_nodes(md, keys, values,
+			                        nr_entries, type, ctx);
+
+		return walk_array_nodes(md, keys, values, nr_entries,
+		                        type, ctx);
 	}
 
-	if (blockcb && blockcb(blockarg, nr, node))
+	/*
+	 * only LEAF_WRITESET type can be here
+	 */
+
+	if (nr_entries && ctx->datacb &&
+	    ctx->datacb(ctx->dataarg, nr_entries, keys, values))
+		return -1;
+
+	if (nr_entries && ctx->leafcb &&
+	    ctx->leafcb(ctx->leafarg, le64toh(node->keys[0]),
+	                nr_entries, keys, values))
 		return -1;
 
-	if (flags & INTERNAL_NODE || type == LEAF_ARRAY || type == LEAF_BITSET)
+	return 0;
+}
+
+/*
+ * walk btree depth-first without recursion: the path from the root
+ * is kept on the stack and stays pinned in md cache, so parent
+ * nodes are never looked up again
+ */
+struct walk_frame {
+	struct btree_node *node;
+	__le64 *values;
+	unsigned nr_entries;
+	unsigned next;
+};
+
+static int walk_btree(struct md *md, uint64_t root, struct walk_ctx *ctx)
+{
+	struct walk_frame stack[BTREE_MAX_DEPTH];
+	struct btree_node *node;
+	unsigned depth = 0;
+	uint64_t nr = root;
+	int rc = -1;
+
+	for (;;)
 	{
-		uint64_t *values;
-		int rc;
+		node = get_btree_node(md, nr, ctx->type);
+		if (!node)
+			goto out;
 
-		for (i = 0; i < nr_entries; i++)
+		if (ctx->blockcb && ctx->blockcb(ctx->blockarg, nr, node))
 		{
+			md_unpin(md, node);
+			goto out;
+		}
+
+		if (le32toh(node->header.flags) & INTERNAL_NODE)
+		{
+			uint64_t children[MD_BLOCK_SIZE / sizeof(uint64_t)];
+			struct walk_frame *f;
+			void *values;
+			unsigned i;
+
+			if (depth == BTREE_MAX_DEPTH)
+			{
+				error(0, "bad btree: too deep");
+				md_unpin(md, node);
+				goto out;
+			}
+
+			values = &node->keys[le32toh(node->header.max_entries)];
+
+			f = &stack[depth++];
+			f->node = node;
+			f->values = values;
+			f->nr_entries = le32toh(node->header.nr_entries);
+			f->next = 0;
+
 			/*
-			 * node address can be changed on
-			 * each iteration due to md cache resize.
+			 * read all children at once
 			 */
-			node = md_block(md, MD_CACHED, nr, BTREE_CSUM_XOR);
-			if (!node)
-				return -1;
+			for (i = 0; i < f->nr_entries; i++)
+				children[i] = le64toh(f->values[i]);
 
-			values = (uint64_t *)&node->keys[max_entries];
+			if (md_prefetch(md, children, f->nr_entries,
+			                BTREE_CSUM_XOR))
+				goto out;
+		}
+		else
+		{
+			int failed = walk_btree_leaf(md, node, ctx->type, ctx);
+			md_unpin(md, node);
 
-			if (flags & INTERNAL_NODE)
-				rc = walk_btree_node(md, values[i], type,
-				                     datacb, dataarg,
-				                     blockcb, blockarg);
-			else
-				rc = walk_array_node(md, values[i], type,
-				                     datacb, dataarg,
-				                     blockcb, blockarg);
+			if (failed)
+				goto out;
+		}
 
-			if (rc == -1)
-				return -1;
+		// go up while the current node has no more children
+		while (depth)
+		{
+			struct walk_frame *f = &stack[depth - 1];
+
+			if (f->next < f->nr_entries)
+			{
+				nr = le64toh(f->values[f->next++]);
+				break;
+			}
+
+			md_unpin(md, f->node);
+			depth--;
 		}
 
-		return 0;
+		if (depth == 0)
+			break;
 	}
 
-	/*
-	 * only LEAF_WRITESET type can be here
-	 */
+	rc = 0;
+out:
+	while (depth)
+		md_unpin(md, stack[--depth].node);
 
-	if (nr_entries && datacb)
-		rc = datacb(dataarg, nr_entries, node->keys,
-		            &node->keys[max_entries]);
+	return rc;
+}
 
-	return rc ? -1 : 0;
+/*
+ * elevator scan: walk btree nodes collecting array block
+ * references first, then read array blocks in disk order;
+ * close blocks are read at once, gaps included
+ */
+
+// largest gap between blocks read together
+#define SCAN_MAX_GAP 8
+
+static int scan_cmp(const void *a, const void *b)
+{
+	const struct scan_entry *x = a, *y = b;
+
+	if (x->nr != y->nr)
+		return x->nr < y->nr ? -1 : 1;
+
+	return x->key < y->key ? -1 : x->key > y->key;
 }
 
-// walk era array
-int era_array_walk(struct md *md, uint64_t root,
-                   datacb_t datacb, void *dataarg,
-                   blockcb_t blockcb, void *blockarg)
+// read collected array blocks in disk order
+static int scan_read(struct md *md, struct scan_list *list,
+                     struct walk_ctx *ctx)
 {
-	if (walk_btree_node(md, root, LEAF_ARRAY,
-	                    datacb, dataarg,
-	                    blockcb, blockarg) == -1)
-		return -1;
+	struct md_csum csums[MD_BATCH_BLOCKS];
+	struct scan_entry *e;
+	uint64_t start;
+	size_t i, j, n;
+	unsigned valid;
 
-	if (datacb && datacb(dataarg, 0, NULL, NULL))
-		return -1;
+	qsort(list->entries, list->count, sizeof(struct scan_entry),
+	      scan_cmp);
+
+	for (i = 0; i < list->count; i += n)
+	{
+		e = &list->entries[i];
+		start = e->nr;
+
+		// the same block twice is not merged, blockcb may reject it
+		for (n = 1; i + n < list->count; n++)
+		{
+			if (e[n].nr == e[n - 1].nr ||
+			    e[n].nr - e[n - 1].nr > SCAN_MAX_GAP + 1 ||
+			    e[n].nr - start >= MD_BATCH_BLOCKS)
+				break;
+		}
+
+		if (md_read_blocks(md, start, e[n - 1].nr - start + 1,
+		                   md->batch))
+			return -1;
+
+		for (j = 0; j < n; j++)
+		{
+			csums[j].block = md->batch +
+			                 MD_BLOCK_SIZE * (e[j].nr - start);
+			csums[j].xor = ARRAY_CSUM_XOR;
+		}
+
+		valid = md_csum_verify_many(csums, n);
+		if (valid != n)
+		{
+			error(0, "bad block checksum: %llu",
+			         (long long unsigned)e[valid].nr);
+			return -1;
+		}
+
+		for (j = 0; j < n; j++)
+			if (walk_array_node(csums[j].block, e[j].nr,
+			                    e[j].key, e[j].type, ctx) == -1)
+				return -1;
+	}
 
 	return 0;
 }
 
-// walk era bitset
-int era_bitset_walk(struct md *md, uint64_t root,
-                    datacb_t datacb, void *dataarg,
-                    blockcb_t blockcb, void *blockarg)
+static int scan_btree(struct md *md, uint64_t root, struct walk_ctx *ctx)
 {
-	if (walk_btree_node(md, root, LEAF_BITSET,
-	                    datacb, dataarg,
-	                    blockcb, blockarg) == -1)
-		return -1;
+	struct scan_list list = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+	int rc;
 
-	if (datacb && datacb(dataarg, 0, NULL, NULL))
-		return -1;
+	ctx->scan = &list;
+	rc = walk_btree(md, root, ctx);
+	ctx->scan = NULL;
+
+	if (!rc)
+		rc = scan_read(md, &list, ctx);
+
+	free(list.entries);
+	return rc;
+}
+
+/*
+ * parallel walk: btree nodes are tasks, each worker keeps
+ * its own deque of them and has its own md view (cache and
+ * io_uring). Children of an internal node are pushed to the
+ * bottom of the worker's deque, the worker pops from the
+ * bottom (depth-first) and idle workers steal from the top,
+ * so they get the largest subtrees left. Workers with nothing
+ * to steal sleep until a task is queued or the walk ends.
+ */
+
+// initial task deque size: siblings of every node on the path
+#define WALK_DEQUE (BTREE_MAX_DEPTH * MD_BLOCK_SIZE / sizeof(uint64_t))
+
+struct walk_task {
+	uint64_t nr;                 /* btree node block number */
+	unsigned depth;              /* node depth */
+	enum leaf_type type;         /* btree of the node */
+};
+
+struct walk_pool;
+
+struct walk_worker {
+	struct walk_pool *pool;
+	struct md *md;               /* private md view */
+	pthread_t thread;
+	pthread_mutex_t lock;        /* protects deque */
+	unsigned head;               /* steal end */
+	unsigned tail;               /* owner end */
+	unsigned size;               /* deque slots, power of 2 */
+	struct walk_task *deque;
+};
+
+struct walk_pool {
+	struct walk_ctx *ctx;
+	struct walk_worker *workers;
+	unsigned count;              /* number of workers */
+	unsigned pending;            /* tasks queued or running */
+	unsigned queued;             /* tasks in deques */
+	unsigned idle;               /* workers waiting for tasks */
+	pthread_mutex_t lock;        /* protects idle workers wait */
+	pthread_cond_t cond;         /* task queued or walk ended */
+	int failed;                  /* some worker failed */
+};
+
+// wake idle workers: one for a new task, all at end of walk
+static void walk_wake(struct walk_pool *pool, int all)
+{
+	if (!__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	if (all)
+		pthread_cond_broadcast(&pool->cond);
+	else
+		pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// wait for a task to steal, returns 0 at end of walk
+static int walk_wait(struct walk_pool *pool)
+{
+	int more;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+	while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) &&
+	       __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) &&
+	       !__atomic_load_n(&pool->failed, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+	more = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) &&
+	       !__atomic_load_n(&pool->failed, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+
+	return more;
+}
+
+/*
+ * queue task; deque grows when full, since bitset trees of
+ * followed writesets leaves come on top of the path siblings
+ */
+static int walk_push(struct walk_worker *w, const struct walk_task *t)
+{
+	struct walk_task *deque;
+	unsigned i, used;
+	int rc = 0;
+
+	pthread_mutex_lock(&w->lock);
+
+	used = w->tail - w->head;
+	if (used == w->size)
+	{
+		deque = malloc(sizeof(*deque) * w->size * 2);
+		if (!deque)
+		{
+			error(ENOMEM, NULL);
+			rc = -1;
+			goto out;
+		}
+
+		for (i = 0; i < used; i++)
+			deque[i] = w->deque[(w->head + i) % w->size];
+
+		free(w->deque);
+		w->deque = deque;
+		w->size *= 2;
+		w->head = 0;
+		w->tail = used;
+	}
+
+	w->deque[w->tail++ % w->size] = *t;
+	__atomic_add_fetch(&w->pool->queued, 1, __ATOMIC_SEQ_CST);
+out:
+	pthread_mutex_unlock(&w->lock);
+
+	if (!rc)
+		walk_wake(w->pool, 0);
+
+	return rc;
+}
+
+static int walk_pop(struct walk_worker *w, struct walk_task *t)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head != w->tail)
+	{
+		*t = w->deque[--w->tail % w->size];
+		__atomic_sub_fetch(&w->pool->queued, 1, __ATOMIC_SEQ_CST);
+		rc = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return rc;
+}
+
+static int walk_steal(struct walk_worker *w, struct walk_task *t)
+{
+	struct walk_pool *pool = w->pool;
+	unsigned self = w - pool->workers;
+	struct walk_worker *v;
+	unsigned i;
+	int rc = 0;
+
+	for (i = 1; i < pool->count && !rc; i++)
+	{
+		v = &pool->workers[(self + i) % pool->count];
+
+		pthread_mutex_lock(&v->lock);
+		if (v->head != v->tail)
+		{
+			*t = v->deque[v->head++ % v->size];
+			__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+			rc = 1;
+		}
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	return rc;
+}
+
+// queue bitset roots of writesets leaf as new btrees
+static int walk_follow(struct walk_worker *w, struct btree_node *node)
+{
+	unsigned max_entries = le32toh(node->header.max_entries);
+	unsigned nr_entries = le32toh(node->header.nr_entries);
+	struct era_writeset *ws = (void *)&node->keys[max_entries];
+	struct walk_task bitset;
+	unsigned i;
+
+	__atomic_add_fetch(&w->pool->pending, nr_entries, __ATOMIC_SEQ_CST);
+
+	bitset.depth = 0;
+	bitset.type = LEAF_BITSET;
+
+	for (i = nr_entries; i > 0; i--)
+	{
+		bitset.nr = le64toh(ws[i - 1].root);
+		if (walk_push(w, &bitset))
+			return -1;
+	}
 
 	return 0;
 }
 
-// walk era writesets
-int era_writesets_walk(struct md *md, uint64_t root,
-                       datacb_t datacb, void *dataarg,
-                       blockcb_t blockcb, void *blockarg)
+/*
+ * visit one btree node: queue children of internal node,
+ * walk leaf
+ */
+static int walk_task(struct walk_worker *w, const struct walk_task *t)
 {
-	if (walk_btree_node(md, root, LEAF_WRITESET,
-	                    datacb, dataarg,
-	                    blockcb, blockarg) == -1)
-		return -1;
+	struct walk_ctx *ctx = w->pool->ctx;
+	struct btree_node *node;
+	int rc = -1;
 
-	if (datacb && datacb(dataarg, 0, NULL, NULL))
+	node = get_btree_node(w->md, t->nr, t->type);
+	if (!node)
 		return -1;
 
-	return 0;
+	if (ctx->blockcb && ctx->blockcb(ctx->blockarg, t->nr, node))
+		goto out;
+
+	if (le32toh(node->header.flags) & INTERNAL_NODE)
+	{
+		uint64_t children[MD_BLOCK_SIZE / sizeof(uint64_t)];
+		unsigned max_entries = le32toh(node->header.max_entries);
+		unsigned nr_entries = le32toh(node->header.nr_entries);
+		void *values = &node->keys[max_entries];
+		struct walk_task child;
+		unsigned i;
+
+		if (t->depth + 1 == BTREE_MAX_DEPTH)
+		{
+			error(0, "bad btree: too deep");
+			goto out;
+		}
+
+		for (i = 0; i < nr_entries; i++)
+			children[i] = le64toh(((__le64 *)values)[i]);
+
+		if (md_prefetch(w->md, children, nr_entries, BTREE_CSUM_XOR))
+			goto out;
+
+		__atomic_add_fetch(&w->pool->pending, nr_entries,
+		                   __ATOMIC_SEQ_CST);
+
+		// last child first: the first one is popped next
+		child.depth = t->depth + 1;
+		child.type = t->type;
+		for (i = nr_entries; i > 0; i--)
+		{
+			child.nr = children[i - 1];
+			if (walk_push(w, &child))
+				goto out;
+		}
+	}
+	else
+	{
+		if (walk_btree_leaf(w->md, node, t->type, ctx))
+			goto out;
+
+		if (t->type == LEAF_WRITESET && ctx->follow &&
+		    walk_follow(w, node))
+			goto out;
+	}
+
+	rc = 0;
+out:
+	md_unpin(w->md, node);
+	return rc;
+}
+
+static void *walk_worker(void *arg)
+{
+	struct walk_worker *w = arg;
+	struct walk_pool *pool = w->pool;
+	struct walk_task t;
+
+	while (!__atomic_load_n(&pool->failed, __ATOMIC_SEQ_CST))
+	{
+		if (!walk_pop(w, &t) && !walk_steal(w, &t))
+		{
+			if (!walk_wait(pool))
+				break;
+			continue;
+		}
+
+		if (walk_task(w, &t))
+		{
+			__atomic_store_n(&pool->failed, 1, __ATOMIC_SEQ_CST);
+			walk_wake(pool, 1);
+		}
+
+		if (!__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST))
+			walk_wake(pool, 1);
+	}
+
+	return NULL;
+}
+
+// worker threads to use by default
+static unsigned walk_threads(unsigned threads)
+{
+	long cpus;
+
+	if (threads == 0)
+	{
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (unsigned)cpus : 1;
+	}
+
+	return threads > WALK_MAX_THREADS ? WALK_MAX_THREADS : threads;
+}
+
+/*
+ * run worker pool over btrees starting from count tasks
+ */
+static int walk_pool_run(struct md *md, const struct walk_task *tasks,
+                         unsigned count, unsigned threads,
+                         struct walk_ctx *ctx)
+{
+	struct walk_pool pool;
+	struct walk_worker *w;
+	unsigned i, started;
+	int rc = -1;
+
+	pool.workers = malloc(sizeof(struct walk_worker) * threads);
+	if (!pool.workers)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
+
+	pool.ctx = ctx;
+	pool.count = threads;
+	pool.pending = count;
+	pool.queued = 0;
+	pool.idle = 0;
+	pool.failed = 0;
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	/*
+	 * the first worker runs in the calling thread with
+	 * the caller's md, others get md views of their own
+	 */
+
+	for (i = 0; i < threads; i++)
+	{
+		w = &pool.workers[i];
+		w->pool = &pool;
+		w->head = 0;
+		w->tail = 0;
+		w->size = WALK_DEQUE;
+
+		w->deque = malloc(sizeof(*w->deque) * WALK_DEQUE);
+		if (!w->deque)
+		{
+			error(ENOMEM, NULL);
+			pool.count = i;
+			goto out;
+		}
+
+		if (i == 0)
+			w->md = md;
+		else
+			w->md = md_clone(md, md->cache_blocks / threads);
+
+		if (!w->md)
+		{
+			free(w->deque);
+			pool.count = i;
+			goto out;
+		}
+
+		pthread_mutex_init(&w->lock, NULL);
+	}
+
+	// the first task is popped first
+	for (i = count; i > 0; i--)
+		if (walk_push(&pool.workers[0], &tasks[i - 1]))
+			goto out;
+
+	for (started = 1; started < threads; started++)
+	{
+		w = &pool.workers[started];
+		if (pthread_create(&w->thread, NULL, walk_worker, w))
+		{
+			error(0, "can't create walk thread");
+			__atomic_store_n(&pool.failed, 1, __ATOMIC_SEQ_CST);
+			walk_wake(&pool, 1);
+			break;
+		}
+	}
+
+	walk_worker(&pool.workers[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	if (!pool.failed)
+		rc = 0;
+out:
+	for (i = 0; i < pool.count; i++)
+	{
+		if (i)
+			md_close(pool.workers[i].md);
+		pthread_mutex_destroy(&pool.workers[i].lock);
+		free(pool.workers[i].deque);
+	}
+
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.workers);
+	return rc;
+}
+
+static int walk_btree_parallel(struct md *md, uint64_t root,
+                               unsigned threads, struct walk_ctx *ctx)
+{
+	struct walk_task t;
+
+	// seeks dominate on rotational device: read in disk order
+	if (md->rotational)
+		return scan_btree(md, root, ctx);
+
+	threads = walk_threads(threads);
+	if (threads == 1)
+		return walk_btree(md, root, ctx);
+
+	t.nr = root;
+	t.depth = 0;
+	t.type = ctx->type;
+
+	return walk_pool_run(md, &t, 1, threads, ctx);
+}
+
+// walk era array
+int era_array_walk(struct md *md, uint64_t root,
+                   datacb_t datacb, void *dataarg,
+                   blockcb_t blockcb, void *blockarg)
+{
+	struct walk_ctx ctx = {
+		LEAF_ARRAY,
+		datacb, dataarg,
+		NULL, NULL,
+		blockcb, blockarg
+	};
+
+	if (walk_btree(md, root, &ctx) == -1)
+		return -1;
+
+	if (datacb && datacb(dataarg, 0, NULL, NULL))
+		return -1;
+
+	return 0;
+}
+
+// walk era bitset
+int era_bitset_walk(struct md *md, uint64_t root,
+                    datacb_t datacb, void *dataarg,
+                    blockcb_t blockcb, void *blockarg)
+{
+	struct walk_ctx ctx = {
+		LEAF_BITSET,
+		datacb, dataarg,
+		NULL, NULL,
+		blockcb, blockarg
+	};
+
+	if (walk_btree(md, root, &ctx) == -1)
+		return -1;
+
+	if (datacb && datacb(dataarg, 0, NULL, NULL))
+		return -1;
+
+	return 0;
+}
+
+// walk era writesets
+int era_writesets_walk(struct md *md, uint64_t root,
+                       datacb_t datacb, void *dataarg,
+                       blockcb_t blockcb, void *blockarg)
+{
+	struct walk_ctx ctx = {
+		LEAF_WRITESET,
+		datacb, dataarg,
+		NULL, NULL,
+		blockcb, blockarg
+	};
+
+	if (walk_btree(md, root, &ctx) == -1)
+		return -1;
+
+	if (datacb && datacb(dataarg, 0, NULL, NULL))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * parallel walks: leafcb and blockcb are called from several
+ * threads at once and in no particular order
+ */
+
+// walk era array in parallel
+int era_array_pwalk(struct md *md, uint64_t root, unsigned threads,
+                    leafcb_t leafcb, void *leafarg,
+                    blockcb_t blockcb, void *blockarg)
+{
+	struct walk_ctx ctx = {
+		LEAF_ARRAY,
+		NULL, NULL,
+		leafcb, leafarg,
+		blockcb, blockarg
+	};
+
+	return walk_btree_parallel(md, root, threads, &ctx);
+}
+
+// walk era bitset in parallel
+int era_bitset_pwalk(struct md *md, uint64_t root, unsigned threads,
+                     leafcb_t leafcb, void *leafarg,
+                     blockcb_t blockcb, void *blockarg)
+{
+	struct walk_ctx ctx = {
+		LEAF_BITSET,
+		NULL, NULL,
+		leafcb, leafarg,
+		blockcb, blockarg
+	};
+
+	return walk_btree_parallel(md, root, threads, &ctx);
+}
+
+/*
+ * metadata walk: all btrees of roots and bitsets of writesets
+ * trees in one run of the worker pool, so worker md views and
+ * their caches are shared by all trees; on rotational device
+ * array blocks are collected by the pool and read in disk
+ * order after it
+ */
+int era_metadata_pwalk(struct md *md, const struct era_walk_root *roots,
+                       unsigned count, unsigned threads, int read_arrays,
+                       leafcb_t leafcb, void *leafarg,
+                       arraycb_t arraycb, void *arrayarg,
+                       blockcb_t blockcb, void *blockarg)
+{
+	struct scan_list list = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+	struct walk_task tasks[WALK_MAX_ROOTS];
+	struct walk_ctx ctx = {
+		LEAF_WRITESET,
+		NULL, NULL,
+		leafcb, leafarg,
+		blockcb, blockarg,
+		NULL,
+		arraycb, arrayarg,
+		1, !read_arrays
+	};
+	unsigned i;
+	int rc;
+
+	if (count > WALK_MAX_ROOTS)
+	{
+		error(0, "too many btree roots: %u", count);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		tasks[i].nr = roots[i].root;
+		tasks[i].depth = 0;
+		tasks[i].type = roots[i].type;
+	}
+
+	// seeks dominate on rotational device: read in disk order
+	if (md->rotational && read_arrays)
+		ctx.scan = &list;
+
+	rc = walk_pool_run(md, tasks, count, walk_threads(threads), &ctx);
+	ctx.scan = NULL;
+
+	if (!rc && list.count)
+		rc = scan_read(md, &list, &ctx);
+
+	free(list.entries);
+	return rc;
+}
+
+/*
+ * cursor: pull leaf value runs one by one, in key order;
+ * the path from the root stays pinned in md cache
+ */
+struct era_cursor {
+	struct md *md;
+	uint64_t root;
+	enum leaf_type type;
+	unsigned depth;
+	struct walk_frame stack[BTREE_MAX_DEPTH];
+
+	void *batch;                 /* array blocks read from leaf */
+	uint64_t keys[CURSOR_BATCH]; /* their keys */
+	unsigned loaded;             /* array blocks in batch */
+	unsigned pos;                /* next array block in batch */
+};
+
+static void cursor_release(struct era_cursor *c)
+{
+	while (c->depth)
+		md_unpin(c->md, c->stack[--c->depth].node);
+
+	c->loaded = 0;
+	c->pos = 0;
+}
+
+// read btree node and put it on top of the path
+static struct walk_frame *cursor_push(struct era_cursor *c, uint64_t nr)
+{
+	struct btree_node *node;
+	struct walk_frame *f;
+	void *values;
+
+	if (c->depth == BTREE_MAX_DEPTH)
+	{
+		error(0, "bad btree: too deep");
+		return NULL;
+	}
+
+	node = get_btree_node(c->md, nr, c->type);
+	if (!node)
+		return NULL;
+
+	values = &node->keys[le32toh(node->header.max_entries)];
+
+	f = &c->stack[c->depth++];
+	f->node = node;
+	f->values = values;
+	f->nr_entries = le32toh(node->header.nr_entries);
+	f->next = 0;
+
+	return f;
+}
+
+// descend to the first leaf entry with key >= searched
+static int cursor_descend(struct era_cursor *c, uint64_t key)
+{
+	struct walk_frame *f;
+	unsigned lo, hi, mid;
+	uint64_t nr = c->root;
+
+	cursor_release(c);
+
+	for (;;)
+	{
+		f = cursor_push(c, nr);
+		if (!f)
+			return -1;
+
+		// first entry with key greater than searched
+		lo = 0;
+		hi = f->nr_entries;
+		while (lo < hi)
+		{
+			mid = (lo + hi) / 2;
+			if (le64toh(f->node->keys[mid]) <= key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (!(le32toh(f->node->header.flags) & INTERNAL_NODE))
+		{
+			if (lo && le64toh(f->node->keys[lo - 1]) == key)
+				lo--;
+			f->next = lo;
+			return 0;
+		}
+
+		if (f->nr_entries == 0)
+			return 0;
+
+		if (lo)
+			lo--;
+
+		f->next = lo + 1;
+		nr = le64toh(f->values[lo]);
+	}
+}
+
+// read next array blocks of the leaf on top of the path
+static int cursor_load(struct era_cursor *c, struct walk_frame *f)
+{
+	const unsigned value_size =
+		c->type == LEAF_ARRAY ? sizeof(uint32_t) : sizeof(uint64_t);
+	struct md_csum csums[CURSOR_BATCH];
+	uint64_t blocks[CURSOR_BATCH];
+	unsigned i, n, valid;
+
+	n = f->nr_entries - f->next;
+	if (n > CURSOR_BATCH)
+		n = CURSOR_BATCH;
+
+	for (i = 0; i < n; i++)
+	{
+		blocks[i] = le64toh(f->values[f->next + i]);
+		c->keys[i] = le64toh(f->node->keys[f->next + i]);
+		csums[i].block = c->batch + MD_BLOCK_SIZE * i;
+		csums[i].xor = ARRAY_CSUM_XOR;
+	}
+
+	if (md_read_many(c->md, blocks, n, c->batch))
+		return -1;
+
+	valid = md_csum_verify_many(csums, n);
+	if (valid != n)
+	{
+		error(0, "bad block checksum: %llu",
+		         (long long unsigned)blocks[valid]);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		struct array_node *node = csums[i].block;
+
+		if (check_array_node(node, blocks[i], c->type))
+			return -1;
+
+		if (le32toh(node->header.max_entries) !=
+		    ARRAY_ENTRIES(value_size))
+		{
+			error(0, "bad array node: max_entries mismatch: "
+			         "expected %u, but got %u",
+			         (unsigned)ARRAY_ENTRIES(value_size),
+			         le32toh(node->header.max_entries));
+			return -1;
+		}
+	}
+
+	f->next += n;
+	c->loaded = n;
+	c->pos = 0;
+
+	return 0;
+}
+
+struct era_cursor *era_cursor_open(struct md *md, uint64_t root,
+                                   enum leaf_type type)
+{
+	struct era_cursor *c;
+
+	c = malloc(sizeof(struct era_cursor));
+	if (!c)
+	{
+		error(ENOMEM, NULL);
+		return NULL;
+	}
+
+	c->md = md;
+	c->root = root;
+	c->type = type;
+	c->depth = 0;
+	c->batch = NULL;
+	c->loaded = 0;
+	c->pos = 0;
+
+	if (type != LEAF_WRITESET)
+	{
+		c->batch = mmap(NULL, MD_BLOCK_SIZE * CURSOR_BATCH,
+		                PROT_READ | PROT_WRITE,
+		                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (c->batch == MAP_FAILED)
+		{
+			error(ENOMEM, NULL);
+			free(c);
+			return NULL;
+		}
+	}
+
+	if (cursor_descend(c, 0))
+	{
+		era_cursor_close(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/*
+ * position cursor so that the next run contains index
+ * (or starts after it, if index is not in the tree)
+ */
+int era_cursor_seek(struct era_cursor *c, uint64_t index)
+{
+	switch (c->type)
+	{
+	case LEAF_ARRAY:
+		index /= ARRAY_ENTRIES(sizeof(uint32_t));
+		break;
+	case LEAF_BITSET:
+		index /= ARRAY_ENTRIES(sizeof(uint64_t));
+		break;
+	case LEAF_WRITESET:
+		break;
+	}
+
+	return cursor_descend(c, index);
+}
+
+/*
+ * get next run of values: index is the position of the first
+ * value (first key for writesets), keys are set for writesets
+ * only; run is valid until the next call
+ *
+ * returns 1 on success, 0 at the end of the tree, -1 on error
+ */
+int era_cursor_next(struct era_cursor *c, uint64_t *index, unsigned *size,
+                    void **keys, void **values)
+{
+	struct walk_frame *f;
+
+	for (;;)
+	{
+		if (c->pos < c->loaded)
+		{
+			struct array_node *node =
+				c->batch + MD_BLOCK_SIZE * c->pos;
+
+			*index = c->keys[c->pos++] *
+			         le32toh(node->header.max_entries);
+			*size = le32toh(node->header.nr_entries);
+			if (keys)
+				*keys = NULL;
+			*values = node->values;
+
+			if (*size)
+				return 1;
+
+			continue;
+		}
+
+		if (c->depth == 0)
+			return 0;
+
+		f = &c->stack[c->depth - 1];
+
+		if (f->next == f->nr_entries)
+		{
+			md_unpin(c->md, f->node);
+			c->depth--;
+			continue;
+		}
+
+		if (le32toh(f->node->header.flags) & INTERNAL_NODE)
+		{
+			if (!cursor_push(c, le64toh(f->values[f->next++])))
+				return -1;
+			continue;
+		}
+
+		if (c->type != LEAF_WRITESET)
+		{
+			if (cursor_load(c, f))
+				return -1;
+			continue;
+		}
+
+		// whole writeset leaf at once
+		*index = le64toh(f->node->keys[f->next]);
+		*size = f->nr_entries - f->next;
+		if (keys)
+			*keys = (void *)f->node + sizeof(struct node_header) +
+			        sizeof(uint64_t) * f->next;
+		*values = (void *)f->values +
+		          sizeof(struct era_writeset) * f->next;
+		f->next = f->nr_entries;
+
+		return 1;
+	}
+}
+
+void era_cursor_close(struct era_cursor *c)
+{
+	cursor_release(c);
+
+	if (c->batch)
+		munmap(c->batch, MD_BLOCK_SIZE * CURSOR_BATCH);
+
+	free(c);
+}
+
+/*
+ * get array values [begin, end) in host byte order: cursor
+ * seeks to begin once and reads only array blocks covering
+ * the range, in key order
+ */
+static int array_lookup_range(struct md *md, uint64_t root,
+                              enum leaf_type type, uint64_t begin,
+                              uint64_t end, void *out)
+{
+	struct era_cursor *c;
+	uint64_t index, pos, to;
+	unsigned size;
+	void *values;
+	int rc = -1;
+
+	if (begin >= end)
+		return 0;
+
+	c = era_cursor_open(md, root, type);
+	if (!c)
+		return -1;
+
+	if (era_cursor_seek(c, begin))
+		goto out;
+
+	for (pos = begin; pos < end; pos = to)
+	{
+		switch (era_cursor_next(c, &index, &size, NULL, &values))
+		{
+		case -1:
+			goto out;
+		case 0:
+			index = pos;
+			size = 0;
+			break;
+		}
+
+		if (index > pos)
+		{
+			error(0, "array block of index %llu not found",
+			         (long long unsigned)pos);
+			goto out;
+		}
+
+		to = index + size < end ? index + size : end;
+
+		if (to <= pos)
+		{
+			error(0, "index %llu is beyond array",
+			         (long long unsigned)pos);
+			goto out;
+		}
+
+		if (type == LEAF_ARRAY)
+		{
+			__le32 *v = values;
+			uint32_t *o = out;
+
+			for (; pos < to; pos++)
+				o[pos - begin] = le32toh(v[pos - index]);
+		}
+		else
+		{
+			__le64 *v = values;
+			uint64_t *o = out;
+
+			for (; pos < to; pos++)
+				o[pos - begin] = le64toh(v[pos - index]);
+		}
+	}
+
+	rc = 0;
+out:
+	era_cursor_close(c);
+	return rc;
+}
+
+// get eras of blocks [begin, end)
+int era_array_lookup_range(struct md *md, uint64_t root,
+                           uint64_t begin, uint64_t end, uint32_t *out)
+{
+	return array_lookup_range(md, root, LEAF_ARRAY, begin, end, out);
+}
+
+// get bitset words [begin, end)
+int era_bitset_lookup_range(struct md *md, uint64_t root,
+                            uint64_t begin, uint64_t end, uint64_t *out)
+{
+	return array_lookup_range(md, root, LEAF_BITSET, begin, end, out);
 }
@@ -14,6 +14,18 @@ enum leaf_type {
 	LEAF_WRITESET = 3
 };
 
+// deepest btree walked
+#define BTREE_MAX_DEPTH 16
+
+// parallel walk threads limit
+#define WALK_MAX_THREADS 16
+
+// array blocks read at once by cursor
+#define CURSOR_BATCH 32
+
+// btree roots of one metadata walk
+#define WALK_MAX_ROOTS 8
+
 #define BTREE_CSUM_XOR 121107
 #define ARRAY_CSUM_XOR 595846735
 
@@ -51,9 +63,28 @@ struct array_node {
 	__u8 values[0];
 } __attribute__ ((packed));
 
+// values per array block
+#define ARRAY_ENTRIES(value_size) \
+	((MD_BLOCK_SIZE - sizeof(struct array_header)) / (value_size))
+
 typedef int (*datacb_t) (void *arg, unsigned size, void *keys, void *vals);
 typedef int (*blockcb_t) (void *arg, uint64_t blocknr, void *block);
 
+/*
+ * parallel walk leaf callback: index is the array position of
+ * the first value for era_array and bitsets, the first key for
+ * writesets
+ */
+typedef int (*leafcb_t) (void *arg, uint64_t index, unsigned size,
+                         void *keys, void *vals);
+
+/*
+ * metadata walk array block callback: key is the array block
+ * index, node is NULL when array blocks are not read
+ */
+typedef int (*arraycb_t) (void *arg, enum leaf_type type, uint64_t key,
+                          struct array_node *node);
+
 int era_array_walk(struct md *md, uint64_t root,
                    datacb_t datacb, void *dataarg,
                    blockcb_t blockcb, void *blockarg);
@@ -66,4 +97,61 @@ int era_writesets_walk(struct md *md, uint64_t root,
                        datacb_t datacb, void *dataarg,
                        blockcb_t blockcb, void *blockarg);
 
+/*
+ * era_array lookups by block number,
+ * bitset lookups by 64-bit word number
+ */
+
+int era_array_lookup_range(struct md *md, uint64_t root,
+                           uint64_t begin, uint64_t end, uint32_t *out);
+
+int era_bitset_lookup_range(struct md *md, uint64_t root,
+                            uint64_t begin, uint64_t end, uint64_t *out);
+
+/*
+ * cursor: pull-based walk, yields runs of leaf values in key order
+ */
+
+struct era_cursor;
+
+struct era_cursor *era_cursor_open(struct md *md, uint64_t root,
+                                   enum leaf_type type);
+int era_cursor_seek(struct era_cursor *c, uint64_t index);
+int era_cursor_next(struct era_cursor *c, uint64_t *index, unsigned *size,
+                    void **keys, void **values);
+void era_cursor_close(struct era_cursor *c);
+
+/*
+ * parallel walks, threads == 0 means one per online cpu;
+ * on rotational devices array blocks are read by one thread
+ * in disk order instead
+ */
+
+int era_array_pwalk(struct md *md, uint64_t root, unsigned threads,
+                    leafcb_t leafcb, void *leafarg,
+                    blockcb_t blockcb, void *blockarg);
+
+int era_bitset_pwalk(struct md *md, uint64_t root, unsigned threads,
+                     leafcb_t leafcb, void *leafarg,
+                     blockcb_t blockcb, void *blockarg);
+
+/*
+ * metadata walk: btrees of all roots and bitsets of writesets
+ * trees in one parallel walk; leafcb gets writesets leaves,
+ * array blocks are read only with read_arrays, in disk order
+ * on rotational devices; blockcb gets NULL block for array
+ * blocks otherwise
+ */
+
+struct era_walk_root {
+	uint64_t root;
+	enum leaf_type type;
+};
+
+int era_metadata_pwalk(struct md *md, const struct era_walk_root *roots,
+                       unsigned count, unsigned threads, int read_arrays,
+                       leafcb_t leafcb, void *leafarg,
+                       arraycb_t arraycb, void *arrayarg,
+                       blockcb_t blockcb, void *blockarg);
+
 #endif
@@ -17,7 +17,6 @@
 #include <errno.h>
 #include <fcntl.h>
 
-#include "crc32c.h"
 #include "era.h"
 #include "era_md.h"
 #include "era_dm.h"
@@ -104,13 +103,9 @@ static int clear_metadata(struct md *md, const char *device)
 
 	if (le32toh(sb->magic) == SUPERBLOCK_MAGIC)
 	{
-		uint32_t csum;
+		struct md_csum csum = { sb, SUPERBLOCK_CSUM_XOR };
 
-		csum = crc_update(crc_init(), &sb->flags,
-		                  MD_BLOCK_SIZE - sizeof(uint32_t));
-		csum ^= SUPERBLOCK_CSUM_XOR;
-
-		if (le32toh(sb->csum) == csum)
+		if (md_csum_verify_many(&csum, 1) == 1)
 		{
 			valid++;
 
@@ -139,7 +134,7 @@ static int clear_metadata(struct md *md, const char *device)
 		return -1;
 	}
 
-	if (md_write(md, 0, empty_block))
+	if (md_write(md, 0, empty_block) || md_sync(md))
 		return -1;
 
 	return 0;
@@ -312,6 +307,7 @@ int era_open(int argc, char **argv)
 	unsigned chunks;
 	struct md *md;
 	int chunk;
+	int clean;
 	int fd;
 
 	/*
@@ -394,10 +390,17 @@ int era_open(int argc, char **argv)
 	}
 
 	/*
-	 * rebuild spacemap
+	 * rebuild spacemap unless metadata is clean since close,
+	 * give metadata an id if it has none yet
 	 */
 
-	if (era_spacemap_rebuild(md))
+	clean = force ? 0 : era_spacemap_clean(md);
+
+	if (clean == 1)
+		printv(1, "era: clean shutdown, spacemap rebuild skipped\n");
+
+	if (clean == -1 || (clean == 0 && era_spacemap_rebuild(md)) ||
+	    era_metadata_set_id(md) || md_sync(md))
 	{
 		(void)era_dm_remove(name);
 		md_close(md);
@@ -480,7 +483,11 @@ int era_close(int argc, char **argv)
 	char target[DM_MAX_TYPE_NAME];
 	char orig[DM_NAME_LEN];
 	char uuid[DM_UUID_LEN];
+	char table[256];
+	unsigned meta_major, meta_minor;
+	struct md *md;
 	char *name;
+	int fd;
 
 	/*
 	 * check and save arguments
@@ -514,6 +521,27 @@ int era_close(int argc, char **argv)
 		goto out;
 	}
 
+	/*
+	 * find metadata device in era table loaded by open
+	 */
+
+	if (era_dm_first_table(name, NULL, NULL, NULL,
+	                       sizeof(target), target,
+	                       sizeof(table), table))
+		goto out;
+
+	if (strcmp(target, TARGET_ERA))
+	{
+		error(0, "unsupported target type: %s", target);
+		goto out;
+	}
+
+	if (sscanf(table, "%u:%u", &meta_major, &meta_minor) != 2)
+	{
+		error(0, "can't parse device table: %s", table);
+		goto out;
+	}
+
 	/*
 	 * check orig device
 	 */
@@ -560,13 +588,40 @@ int era_close(int argc, char **argv)
 	 * remove era and orig devices
 	 */
 
-	if (era_dm_remove(name))
+	fd = blkopen2(meta_major, meta_minor, 1, NULL);
+	if (fd == -1)
 		goto out;
 
+	if (era_dm_remove(name))
+		goto out_close;
+
 	if (era_dm_remove(orig))
-		goto out;
+		goto out_close;
+
+	/*
+	 * mark metadata clean, so next open skips spacemap rebuild
+	 */
+
+	md = md_open(NULL, fd);
+	if (!md)
+		goto out_clean;
+
+	if (era_spacemap_mark_clean(md))
+	{
+		md_close(md);
+		goto out_clean;
+	}
+
+	if (md_close(md))
+		goto out_clean;
 
 	return 0;
+out_clean:
+	error(0, "device %s removed, but can't mark metadata clean, "
+	         "spacemap will be rebuilt on open", name);
+	return -1;
+out_close:
+	close(fd);
 out:
 	return -1;
 }
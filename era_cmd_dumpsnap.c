@@ -32,12 +32,13 @@ int era_dumpsnap(int argc, char **argv)
 	struct era_snapshot_superblock *ssb;
 	struct era_dm_info info;
 	char uuid[UUID_LEN];
+	struct era_snapshot_reader *r;
 	uint64_t era_size, length;
-	unsigned nr, count, last;
-	unsigned i, snap_blocks;
-	unsigned j, nr_blocks;
+	unsigned start, count;
+	unsigned nr_blocks;
 	unsigned chunk;
 	unsigned era;
+	int rc;
 
 	if (argc == 0)
 	{
@@ -76,8 +77,6 @@ int era_dumpsnap(int argc, char **argv)
 		goto out;
 	}
 
-	snap_blocks = (nr_blocks + ERAS_PER_BLOCK - 1) / ERAS_PER_BLOCK;
-
 	/*
 	 * check snapshot device
 	 */
@@ -110,80 +109,32 @@ int era_dumpsnap(int argc, char **argv)
 	}
 
 	/*
-	 * dump snapshot blocks
+	 * dump snapshot runs
 	 */
 
+	r = era_snapshot_open(sn);
+	if (!r)
+		goto out;
+
 	printf("<snapshot block_size=\"%u\" blocks=\"%u\" era=\"%u\"\n"
 	       "          dev=\"/dev/mapper/%s\">\n",
 	       chunk, nr_blocks, era, dmname);
 
-	count = 0;
-	nr = 0;
-
-	for (i = 0; i < snap_blocks; i++)
+	while ((rc = era_snapshot_next_run(r, &start, &count, &era)) == 1)
 	{
-		struct era_snapshot_node *node;
-
-		node = md_block(sn, 0, i + 1, SNAP_ARRAY_CSUM_XOR);
-		if (!node)
-			goto out;
-
-		if (le64toh(node->blocknr) != i + 1)
-		{
-			error(0, "bad block number: expected %u, but got %u",
-			      i + 1, (unsigned)le64toh(node->blocknr));
-			goto out;
-		}
-
-		for (j = 0; j < ERAS_PER_BLOCK; j++, nr++)
-		{
-			unsigned era;
-
-			if (nr >= nr_blocks)
-				break;
-
-			era = le32toh(node->era[j]);
-
-			if (count == 0)
-			{
-				last = era;
-				count++;
-				continue;
-			}
-
-			if (last == era)
-			{
-				count++;
-				continue;
-			}
-
-			if (count == 1)
-			{
-				printf("  <block block=\"%u\" era=\"%u\"/>\n",
-				       nr - 1, last);
-			}
-			else {
-				printf("  <range begin=\"%u\" end=\"%u\" "
-				       "era=\"%u\"/>\n",
-				       nr - count, nr - 1, last);
-			}
-
-			last = era;
-			count = 1;
-		}
+		if (count == 1)
+			printf("  <block block=\"%u\" era=\"%u\"/>\n",
+			       start, era);
+		else
+			printf("  <range begin=\"%u\" end=\"%u\" "
+			       "era=\"%u\"/>\n",
+			       start, start + count - 1, era);
 	}
 
-	switch (count)
-	{
-	case 0:
-		break;
-	case 1:
-		printf("  <block block=\"%u\" era=\"%u\"/>\n", nr - 1, last);
-		break;
-	default:
-		printf("  <range begin=\"%u\" end=\"%u\" era=\"%u\"/>\n",
-		       nr - count, nr - 1, last);
-	}
+	era_snapshot_close(r);
+
+	if (rc)
+		goto out;
 
 	printf("</snapshot>\n");
 
@@ -11,7 +11,9 @@
 #include <unistd.h>
 #include <endian.h>
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "crc32c.h"
 #include "era.h"
@@ -35,7 +37,6 @@ static void *get_snapshot_uuid(struct md *sn, const char *device)
 {
 	struct era_snapshot_superblock *ssb;
 	static char uuid[UUID_LEN];
-	int fd;
 
 	ssb = md_block(sn, MD_NOCRC, 0, 0);
 	if (!ssb)
@@ -43,14 +44,11 @@ static void *get_snapshot_uuid(struct md *sn, const char *device)
 
 	if (le32toh(ssb->magic) == SNAP_SUPERBLOCK_MAGIC)
 	{
-		uint32_t csum;
-
-		csum = crc_update(crc_init(), &ssb->flags,
-		                  MD_BLOCK_SIZE - sizeof(uint32_t));
-		csum ^= SNAP_SUPERBLOCK_CSUM_XOR;
+		struct md_csum csum = { ssb, SNAP_SUPERBLOCK_CSUM_XOR };
 
-		if (le32toh(ssb->csum) == csum &&
-		    le32toh(ssb->version) == SNAP_VERSION)
+		if (md_csum_verify_many(&csum, 1) == 1 &&
+		    le32toh(ssb->version) >= SNAP_MIN_VERSION &&
+		    le32toh(ssb->version) <= SNAP_VERSION)
 		{
 			memcpy(uuid, ssb->uuid, UUID_LEN);
 			return uuid;
@@ -63,85 +61,177 @@ static void *get_snapshot_uuid(struct md *sn, const char *device)
 		return NULL;
 	}
 
-	fd = open(RANDOM_DEVICE, O_RDONLY);
-	if (fd == -1)
-	{
-		error(errno, "can't open %s", RANDOM_DEVICE);
+	if (random_uuid(uuid))
 		return NULL;
-	}
-
-	if (read(fd, uuid, UUID_LEN) != UUID_LEN)
-	{
-		error(errno, "can't read %s", RANDOM_DEVICE);
-		close(fd);
-		return NULL;
-	}
-
-	close(fd);
 
 	return uuid;
 }
 
-int era_takesnap(int argc, char **argv)
+/*
+ * most recent snapshot of the same origin,
+ * found the way era_status finds snapshots
+ */
+struct prev_snapshot {
+	const char *skip;            /* snapshot being created */
+	unsigned major;              /* real origin device */
+	unsigned minor;
+	uint64_t era_size;           /* expected geometry */
+	unsigned chunk;
+	unsigned nr_blocks;
+	struct md *md;               /* snapshot metadata or NULL */
+	unsigned era;                /* its snapshot_era */
+};
+
+static int prev_snapshot_cb(void *arg, const char *name)
 {
-	void *uuid;
-	char *snap_path;
-	struct md *md, *sn;
-	struct era_superblock *sb;
+	struct prev_snapshot *ps = arg;
 	struct era_snapshot_superblock *ssb;
-	uint32_t csum;
-	uint64_t snap_offset;
-	unsigned nr_blocks, snap_blocks;
-	unsigned replace_with_linear;
-	unsigned drop_metadata_snap;
-	unsigned long *bitmap;
-	unsigned long long meta_snap;
-	unsigned long long meta_used;
-	unsigned long long meta_total;
-	unsigned meta_major, meta_minor;
-	unsigned orig_major, orig_minor;
-	unsigned real_major, real_minor;
-	unsigned chunk, meta_chunk;
-	unsigned current_era;
-	struct device *era, *orig;
-	struct device *snap, *cow;
-	size_t len;
+	struct era_dm_info info;
+	char target[DM_MAX_TYPE_NAME];
+	char table[256];
+	char cow_uuid[DM_UUID_LEN];
+	unsigned long long offset;
+	unsigned major, minor;
+	struct md *sn;
 	int fd;
 
-	switch (argc)
-	{
-	case 0:
-		error(0, "device name argument expected");
-		usage(stderr, 1);
-	case 1:
-		error(0, "snapshot device argument expected");
-		usage(stderr, 1);
-	case 2:
-		break;
-	default:
-		error(0, "unknown argument: %s", argv[2]);
-		usage(stderr, 1);
-	}
+	if (strncmp(name, "era-snap-", 9) || !strcmp(name, ps->skip))
+		return 0;
+
+	if (era_dm_info(name, NULL, &info, 0, NULL, 0, NULL))
+		return 0;
+
+	if (!info.exists || info.suspended || info.target_count != 1)
+		return 0;
 
-	era = malloc(sizeof(*era));
-	cow = malloc(sizeof(*cow));
-	snap = malloc(sizeof(*snap));
-	orig = malloc(sizeof(*orig));
+	if (era_dm_first_table(name, NULL, NULL, NULL,
+	                       sizeof(target), target,
+	                       sizeof(table), table))
+		return 0;
 
-	if (!era || !cow || !snap || !orig)
+	if (strcmp(target, TARGET_SNAPSHOT) ||
+	    sscanf(table, "%u:%u", &major, &minor) != 2 ||
+	    major != ps->major || minor != ps->minor)
+		return 0;
+
+	// snapshot metadata is in front of the cow area
+	snprintf(cow_uuid, sizeof(cow_uuid), "ERA-SNAP-%s-cow", name + 9);
+
+	if (era_dm_first_table(NULL, cow_uuid, NULL, NULL,
+	                       sizeof(target), target,
+	                       sizeof(table), table))
+		return 0;
+
+	if (strcmp(target, TARGET_LINEAR) ||
+	    sscanf(table, "%u:%u %llu", &major, &minor, &offset) != 3)
+		return 0;
+
+	fd = blkopen2(major, minor, 0, NULL);
+	if (fd == -1)
+		return 0;
+
+	sn = md_open(NULL, fd);
+	if (!sn)
+		return 0;
+
+	ssb = md_block(sn, 0, 0, SNAP_SUPERBLOCK_CSUM_XOR);
+	if (!ssb || era_ssb_check(ssb) ||
+	    strcmp(name + 9, uuid2str(ssb->uuid)) ||
+	    le64toh(ssb->era_size) != ps->era_size ||
+	    le32toh(ssb->data_block_size) != ps->chunk ||
+	    le32toh(ssb->nr_blocks) != ps->nr_blocks ||
+	    (ps->md && le32toh(ssb->snapshot_era) <= ps->era))
 	{
-		error(ENOMEM, NULL);
-		goto out;
+		md_close(sn);
+		return 0;
 	}
 
-	snprintf(era->name, sizeof(era->name), "%s", argv[0]);
-	snap_path = argv[1];
+	if (ps->md)
+		md_close(ps->md);
 
-	sn = NULL;
-	md = NULL;
+	ps->md = sn;
+	ps->era = le32toh(ssb->snapshot_era);
 
-	replace_with_linear = 0;
-	drop_metadata_snap = 0;
+	return 0;
+}
+
+/*
+ * --max-suspend-ms: devices are suspended one by one and the
+ * snapshot is committed by its resume, so the deadline is
+ * checked after every suspend and before the commit; past it
+ * the snapshot is aborted and devices resume their tables
+ */
+static int suspend_expired(double deadline)
+{
+	if (!max_suspend_ms || now_ms() <= deadline)
+		return 0;
+
+	error(0, "suspend time limit of %d ms exceeded, "
+	         "snapshot aborted", max_suspend_ms);
+	return 1;
+}
+
+/*
+ * takesnap state of one volume
+ */
+struct volume {
+	struct device era;
+	struct device orig;
+	struct device snap;
+	struct device cow;
+
+	const char *snap_path;
+	char uuid[UUID_LEN];
+	char metadata_id[UUID_LEN];   /* era metadata id */
+
+	struct md *md;               /* era metadata */
+	struct md *sn;               /* snapshot metadata */
+	struct prev_snapshot prev;   /* snapshot to build from */
+
+	unsigned nr_blocks;
+	unsigned nr_extents;
+	unsigned extent_blocks;
+	unsigned snap_blocks;        /* extent and bitmap blocks */
+	unsigned chunk;
+	unsigned current_era;
+	unsigned real_major;
+	unsigned real_minor;
+	unsigned long long meta_snap;
+
+	int created;                 /* snapshot device exists */
+	int cow_created;             /* cow device exists */
+	int replace_with_linear;     /* origin was linear */
+	int drop_metadata_snap;      /* metadata snapshot is taken */
+
+	pthread_t thread;            /* metadata copy */
+	int rc;
+
+	struct md_stats io;          /* counters of closed md views */
+	double prepare_ms;           /* phase timings */
+	double copy_ms;
+	double load_ms;
+	double bitmap_ms;
+	double digest_ms;
+	double superblock_ms;
+};
+
+/*
+ * check era device, create snapshot device
+ * and switch origin to the "snapshot-origin" target
+ */
+static int volume_prepare(struct volume *v)
+{
+	struct device *era = &v->era;
+	struct device *orig = &v->orig;
+	struct device *snap = &v->snap;
+	unsigned long long meta_used;
+	unsigned long long meta_total;
+	unsigned meta_major, meta_minor;
+	unsigned orig_major, orig_minor;
+	unsigned meta_chunk;
+	void *uuid;
+	size_t len;
+	int fd;
 
 	/*
 	 * open metadata device
@@ -149,47 +239,47 @@ int era_takesnap(int argc, char **argv)
 
 	if (era_dm_info(era->name, NULL, &era->info,
 	                0, NULL, sizeof(era->uuid), era->uuid))
-		goto out;
+		return -1;
 
 	if (!era->info.exists)
 	{
 		error(0, "device %s does not exists", era->name);
-		goto out;
+		return -1;
 	}
 
 	if (era->info.target_count != 1)
 	{
 		error(0, "invalid device %s", era->name);
-		goto out;
+		return -1;
 	}
 
 	if (era_dm_first_table(era->name, NULL, NULL, &era->size,
 	                       sizeof(era->target), era->target,
 	                       sizeof(era->table), era->table))
-		goto out;
+		return -1;
 
 	if (strcmp(era->target, TARGET_ERA))
 	{
 		error(0, "unsupported target type: %s", era->target);
-		goto out;
+		return -1;
 	}
 
 	if (sscanf(era->table, "%u:%u %u:%u %u",
 	           &meta_major, &meta_minor,
 	           &orig_major, &orig_minor,
-	           &chunk) != 5)
+	           &v->chunk) != 5)
 	{
 		error(0, "can't parse device table: %s", era->table);
-		goto out;
+		return -1;
 	}
 
 	fd = blkopen2(meta_major, meta_minor, 0, NULL);
 	if (fd == -1)
-		goto out;
+		return -1;
 
-	md = md_open(NULL, fd);
-	if (!md)
-		goto out;
+	v->md = md_open(NULL, fd);
+	if (!v->md)
+		return -1;
 
 	printv(1, "era: era %s\n", era->table);
 
@@ -199,33 +289,33 @@ int era_takesnap(int argc, char **argv)
 
 	if (era_dm_first_status(era->name, NULL, NULL, NULL,
 	                        0, NULL, sizeof(era->status), era->status))
-		goto out;
+		return -1;
 
 	len = strlen(era->status);
 
 	if (len == 0)
 	{
 		error(0, "empty device status: %s", era->name);
-		goto out;
+		return -1;
 	}
 
 	if (era->status[len - 1] != '-')
 	{
 		error(0, "another snapshot in progress: %s", era->name);
-		goto out;
+		return -1;
 	}
 
 	if (sscanf(era->status, "%u %llu/%llu %u -", &meta_chunk,
-	           &meta_used, &meta_total, &current_era) != 4)
+	           &meta_used, &meta_total, &v->current_era) != 4)
 	{
 		error(0, "can't parse era status: %s", era->status);
-		goto out;
+		return -1;
 	}
 
 	if ((meta_chunk << SECTOR_SHIFT) != MD_BLOCK_SIZE)
 	{
 		error(0, "unexpected metadata block size: %u", meta_chunk);
-		goto out;
+		return -1;
 	}
 
 	printv(1, "era: %s\n", era->status);
@@ -234,68 +324,47 @@ int era_takesnap(int argc, char **argv)
 	 * open snapshot device
 	 */
 
-	sn = md_open(snap_path, 1);
-	if (!sn)
-		goto out;
+	v->sn = md_open(v->snap_path, 1);
+	if (!v->sn)
+		return -1;
 
-	uuid = get_snapshot_uuid(sn, snap_path);
+	uuid = get_snapshot_uuid(v->sn, v->snap_path);
 	if (!uuid)
-		goto out;
+		return -1;
 
-	printv(1, "snapshot: uuid %s\n", uuid2str(uuid));
+	memcpy(v->uuid, uuid, UUID_LEN);
 
-	/*
-	 * calculate era array size
-	 */
-
-	nr_blocks = (unsigned)((era->size + chunk - 1) / chunk);
-	snap_blocks = (nr_blocks + ERAS_PER_BLOCK - 1) / ERAS_PER_BLOCK;
-	snap_offset = (1 + snap_blocks) * meta_chunk;
-
-	printv(1, "snapshot: metadata %llu KiB\n",
-	       (long long unsigned)((snap_offset << SECTOR_SHIFT) / 1024));
+	printv(1, "snapshot: uuid %s\n", uuid2str(v->uuid));
 
 	/*
-	 * create snapshot and cow devices
+	 * calculate era array size, extents are counted on copy:
+	 * superblock, bitmap and at least one extent block are needed
 	 */
 
-	if (snap_offset >= sn->sectors)
+	v->nr_blocks = (unsigned)((era->size + v->chunk - 1) / v->chunk);
+
+	if ((2 + SNAP_BITMAP_BLOCKS(v->nr_blocks)) * (uint64_t)meta_chunk >=
+	    v->sn->sectors)
 	{
 		error(0, "snapshot device too small");
-		goto out;
+		return -1;
 	}
 
+	/*
+	 * create snapshot device, it gets its table on load
+	 */
+
 	snprintf(snap->name, sizeof(snap->name),
-	         "era-snap-%s", uuid2str(uuid));
+	         "era-snap-%s", uuid2str(v->uuid));
 
 	snprintf(snap->uuid, sizeof(snap->uuid),
-	         "ERA-SNAP-%s", uuid2str(uuid));
+	         "ERA-SNAP-%s", uuid2str(v->uuid));
 
 	if (era_dm_create_empty(snap->name, snap->uuid, NULL))
-		goto out;
+		return -1;
 
-	snprintf(cow->name, sizeof(cow->name),
-	         "era-snap-%s-cow", uuid2str(uuid));
-
-	snprintf(cow->uuid, sizeof(cow->uuid),
-	         "ERA-SNAP-%s-cow", uuid2str(uuid));
-
-	snprintf(cow->table, sizeof(cow->table),
-	         "%u:%u %llu", sn->major, sn->minor,
-	         (long long unsigned)snap_offset);
-
-	strcpy(cow->target, TARGET_LINEAR);
+	v->created++;
 
-	cow->size = sn->sectors - snap_offset;
-
-	if (era_dm_create(cow->name, cow->uuid, 0, cow->size,
-	                  cow->target, cow->table, &cow->info))
-	{
-		era_dm_remove(snap->name);
-		goto out;
-	}
-
-	printv(1, "snapshot: cow %s\n", cow->name);
 	printv(1, "snapshot: name %s\n", snap->name);
 
 	/*
@@ -306,12 +375,12 @@ int era_takesnap(int argc, char **argv)
 
 	if (era_dm_info(NULL, orig->uuid, &orig->info,
 	                sizeof(orig->name), orig->name, 0, NULL))
-		goto out_snap;
+		return -1;
 
 	if (!orig->info.exists)
 	{
 		error(0, "origin device does not exists: %s", orig->uuid);
-		goto out_snap;
+		return -1;
 	}
 
 	if (orig->info.target_count != 1 ||
@@ -319,20 +388,20 @@ int era_takesnap(int argc, char **argv)
 	    orig->info.minor != orig_minor)
 	{
 		error(0, "invalid origin device: %s", orig->name);
-		goto out_snap;
+		return -1;
 	}
 
 	if (era_dm_first_table(NULL, orig->uuid, NULL, &orig->size,
 	                       sizeof(orig->target), orig->target,
 	                       sizeof(orig->table), orig->table))
-		goto out_snap;
+		return -1;
 
 	if (era->size != orig->size)
 	{
 		error(0, "unexpected origin size: expected %llu, but got %llu",
 		      (long long unsigned)era->size,
 		      (long long unsigned)orig->size);
-		goto out_snap;
+		return -1;
 	}
 
 	printv(1, "origin: %s %s\n", orig->target, orig->table);
@@ -342,26 +411,26 @@ int era_takesnap(int argc, char **argv)
 		long long unsigned zero = 3;
 
 		if (sscanf(orig->table, "%u:%u %llu",
-		           &real_major, &real_minor, &zero) != 3)
+		           &v->real_major, &v->real_minor, &zero) != 3)
 		{
 			error(0, "can't parse origin table: %s", orig->table);
-			goto out_snap;
+			return -1;
 		}
 
 		if (zero)
 		{
 			error(0, "invalid origin table: %s", orig->table);
-			goto out_snap;
+			return -1;
 		}
 
 		strcpy(orig->target, TARGET_ORIGIN);
 		snprintf(orig->table, sizeof(orig->table), "%u:%u",
-		         real_major, real_minor);
+		         v->real_major, v->real_minor);
 
 		printv(1, "origin: suspend\n");
 
 		if (era_dm_suspend(orig->name))
-			goto out_snap;
+			return -1;
 
 		printv(1, "origin: %s %s\n", orig->target, orig->table);
 
@@ -369,269 +438,650 @@ int era_takesnap(int argc, char **argv)
 		                orig->target, orig->table, NULL))
 		{
 			era_dm_resume(orig->name);
-			goto out_snap;
+			return -1;
 		}
 
-		replace_with_linear++;
+		v->replace_with_linear++;
 
 		printv(1, "origin: resume\n");
 
 		if (era_dm_resume(orig->name))
-			goto out_snap;
+			return -1;
 	}
 
 	if (strcmp(orig->target, TARGET_ORIGIN))
 	{
 		error(0, "unsupported origin target: %s", orig->target);
-		goto out_snap;
+		return -1;
 	}
 
-	if (sscanf(orig->table, "%u:%u", &real_major, &real_minor) != 2)
+	if (sscanf(orig->table, "%u:%u",
+	           &v->real_major, &v->real_minor) != 2)
 	{
 		error(0, "can't parse origin table: %s", orig->table);
-		goto out_snap;
+		return -1;
 	}
 
 	/*
-	 * send take_metadata_snap to era
+	 * find previous snapshot to build the new one from
 	 */
 
-	printv(1, "era: take metadata snapshot\n");
+	v->prev.skip = snap->name;
+	v->prev.major = v->real_major;
+	v->prev.minor = v->real_minor;
+	v->prev.era_size = era->size;
+	v->prev.chunk = v->chunk;
+	v->prev.nr_blocks = v->nr_blocks;
 
-	if (era_dm_message0(era->name, "take_metadata_snap"))
-		goto out_snap;
+	if (era_dm_list(prev_snapshot_cb, &v->prev))
+		return -1;
 
-	drop_metadata_snap++;
+	if (v->prev.md)
+		printv(1, "snapshot: previous snapshot at era %u\n",
+		       v->prev.era);
 
-	if (era_dm_first_status(NULL, era->uuid, NULL, NULL, 0, NULL,
-	                        sizeof(era->status), era->status))
-		goto out_snap_drop;
+	return 0;
+}
 
-	len = strlen(era->status);
+/*
+ * send take_metadata_snap to era, era is rolled over
+ * and returned in era, metadata snapshot location in v
+ */
+static int volume_metadata_snap(struct volume *v, unsigned *era)
+{
+	unsigned long long meta_used;
+	unsigned long long meta_total;
+	unsigned meta_chunk;
 
-	if (len == 0)
-	{
-		error(0, "empty status: %s", era->name);
-		goto out_snap_drop;
-	}
+	printv(1, "era: take metadata snapshot of %s\n", v->era.name);
+
+	if (era_dm_message0(v->era.name, "take_metadata_snap"))
+		return -1;
+
+	v->drop_metadata_snap++;
 
-	if (sscanf(era->status, "%u %llu/%llu %u %llu", &meta_chunk,
-	           &meta_used, &meta_total, &current_era, &meta_snap) != 5)
+	if (era_dm_first_status(NULL, v->era.uuid, NULL, NULL, 0, NULL,
+	                        sizeof(v->era.status), v->era.status))
+		return -1;
+
+	if (sscanf(v->era.status, "%u %llu/%llu %u %llu", &meta_chunk,
+	           &meta_used, &meta_total, era, &v->meta_snap) != 5)
 	{
-		error(0, "can't parse era status: %s", era->status);
-		goto out_snap_drop;
+		error(0, "can't parse era status: %s", v->era.status);
+		return -1;
 	}
 
-	if (meta_snap == 0)
+	if (v->meta_snap == 0)
 	{
 		error(0, "invalid era metadata snapshot offset: %llu",
-		      meta_snap);
-		goto out_snap_drop;
+		      v->meta_snap);
+		return -1;
 	}
 
-	printv(1, "era: %s\n", era->status);
+	printv(1, "era: %s\n", v->era.status);
 
-	/*
-	 * copy era_array and all archived writesets to snapshot
-	 */
+	return 0;
+}
 
-	printv(1, "era: copy metadata snapshot\n");
+static int volume_drop_metadata_snap(struct volume *v)
+{
+	printv(1, "era: drop metadata snapshot of %s\n", v->era.name);
 
-	if (era_snapshot_copy(md, sn, (uint64_t)meta_snap, nr_blocks))
-		goto out_snap_drop;
+	if (era_dm_message0(v->era.name, "drop_metadata_snap"))
+		return -1;
 
-	/*
-	 * drop metadata snapshot
-	 */
+	v->drop_metadata_snap = 0;
 
-	printv(1, "era: drop metadata snapshot\n");
+	return 0;
+}
 
-	if (era_dm_message0(era->name, "drop_metadata_snap"))
-		goto out_snap_drop;
+/*
+ * copy era_array and all archived writesets to snapshot,
+ * runs in its own thread for every volume but the first one
+ */
+static void *volume_copy(void *arg)
+{
+	struct volume *v = arg;
+	double start = now_ms();
 
-	drop_metadata_snap = 0;
+	printv(1, "era: copy metadata snapshot of %s\n", v->era.name);
 
-	/*
-	 * suspend era and origin devices
-	 */
+	v->rc = era_snapshot_copy(v->md, v->sn, v->prev.md,
+	                          (uint64_t)v->meta_snap, v->nr_blocks,
+	                          &v->nr_extents, &v->extent_blocks,
+	                          v->metadata_id);
 
-	printv(1, "era: suspend\n");
+	v->copy_ms = now_ms() - start;
 
-	if (era_dm_suspend(era->name))
-		goto out_resume;
+	if (v->prev.md)
+	{
+		md_stats_add(&v->io, &v->prev.md->stats);
+		md_close(v->prev.md);
+		v->prev.md = NULL;
+	}
 
-	printv(1, "origin: suspend\n");
+	return NULL;
+}
 
-	if (era_dm_suspend(orig->name))
-		goto out_resume;
+/*
+ * prepare snapshot device: cow device right after snapshot
+ * metadata, empty cow header and inactive table, nothing but
+ * table swaps is left for the suspended section
+ */
+static int volume_load(struct volume *v)
+{
+	struct device *snap = &v->snap;
+	struct device *cow = &v->cow;
+	uint64_t snap_offset;
 
-	/*
-	 * read and check superblock
-	 */
+	v->snap_blocks = v->extent_blocks + SNAP_BITMAP_BLOCKS(v->nr_blocks);
+	snap_offset = (1 + v->snap_blocks) *
+	              (uint64_t)(MD_BLOCK_SIZE >> SECTOR_SHIFT);
 
-	sb = md_block(md, MD_CACHED, 0, SUPERBLOCK_CSUM_XOR);
-	if (!sb || era_sb_check(sb))
-		goto out_resume;
+	printv(1, "snapshot: metadata %llu KiB, %u extents\n",
+	       (long long unsigned)((snap_offset << SECTOR_SHIFT) / 1024),
+	       v->nr_extents);
 
-	if (le32toh(sb->current_era) != current_era)
+	if (snap_offset >= v->sn->sectors)
 	{
-		error(0, "unexpected current era after suspend: "
-		         "expected %u, but got %u",
-		         current_era, le32toh(sb->current_era));
-		goto out_resume;
+		error(0, "snapshot device too small");
+		return -1;
 	}
 
-	/*
-	 * copy bitmap for current era
-	 */
+	snprintf(cow->name, sizeof(cow->name),
+	         "era-snap-%s-cow", uuid2str(v->uuid));
 
-	printv(1, "era: get bitmap for era %u\n", current_era);
+	snprintf(cow->uuid, sizeof(cow->uuid),
+	         "ERA-SNAP-%s-cow", uuid2str(v->uuid));
 
-	bitmap = era_snapshot_getbitmap(md, current_era, 0, nr_blocks);
-	if (!bitmap)
-		goto out_resume;
+	snprintf(cow->table, sizeof(cow->table),
+	         "%u:%u %llu", v->sn->major, v->sn->minor,
+	         (long long unsigned)snap_offset);
 
-	/*
-	 * load table into snapshot device
-	 */
+	strcpy(cow->target, TARGET_LINEAR);
+
+	cow->size = v->sn->sectors - snap_offset;
+
+	if (era_dm_create(cow->name, cow->uuid, 0, cow->size,
+	                  cow->target, cow->table, &cow->info))
+		return -1;
+
+	v->cow_created++;
+
+	printv(1, "snapshot: cow %s\n", cow->name);
 
 	strcpy(snap->target, TARGET_SNAPSHOT);
 
 	snprintf(snap->table, sizeof(snap->table), "%u:%u %u:%u %s %u",
-	         real_major, real_minor, cow->info.major, cow->info.minor,
+	         v->real_major, v->real_minor,
+	         v->cow.info.major, v->cow.info.minor,
 	         SNAPSHOT_PERSISTENT, SNAPSHOT_CHUNK);
 
 	printv(1, "snapshot: %s %s\n", snap->target, snap->table);
 
-	if (md_write(sn, snap_blocks + 1, empty_block))
-	{
-		free(bitmap);
-		goto out_resume;
-	}
+	if (md_write(v->sn, v->snap_blocks + 1, empty_block))
+		return -1;
 
-	if (era_dm_load(snap->name, 0, era->size,
-	                snap->target, snap->table, &snap->info))
-	{
-		free(bitmap);
-		goto out_resume;
-	}
-
-	printv(1, "snapshot: resume\n");
+	return era_dm_load(snap->name, 0, v->era.size,
+	                   snap->target, snap->table, &snap->info);
+}
 
-	if (era_dm_resume(snap->name))
-	{
-		free(bitmap);
-		goto out_resume;
-	}
+/*
+ * digest bitmap of snapshot era and save snapshot superblock
+ */
+static int volume_finish(struct volume *v)
+{
+	struct era_snapshot_superblock *ssb;
+	struct md_csum csum;
+	unsigned long *bitmap;
+	unsigned next_era;
+	double start = now_ms();
 
 	/*
-	 * resume era device
+	 * copy bitmap for current era: its writeset was archived
+	 * on suspend, read it from a new metadata snapshot
 	 */
 
-	printv(1, "origin: resume\n");
+	if (volume_metadata_snap(v, &next_era))
+		return -1;
 
-	if (era_dm_resume(orig->name))
+	// one rollover on resume and one for metadata snapshot
+	if (next_era != v->current_era + 2)
 	{
-		free(bitmap);
-		goto out_resume;
+		error(0, "unexpected era after resume: "
+		         "expected %u, but got %u",
+		         v->current_era + 2, next_era);
+		return -1;
 	}
 
-	printv(1, "era: resume\n");
+	printv(1, "era: get bitmap for era %u\n", v->current_era);
+
+	bitmap = era_snapshot_getbitmap(v->md, v->current_era,
+	                                (uint64_t)v->meta_snap,
+	                                v->nr_blocks);
+	if (!bitmap)
+		return -1;
 
-	if (era_dm_resume(era->name))
+	if (volume_drop_metadata_snap(v))
 	{
 		free(bitmap);
-		goto out_resume;
+		return -1;
 	}
 
+	v->bitmap_ms = now_ms() - start;
+	start = now_ms();
+
 	/*
-	 * digest bitmap
+	 * write bitmap after extents
 	 */
 
-	printv(1, "snapshot: digest bitmap for era %u\n", current_era);
+	printv(1, "snapshot: write bitmap for era %u\n", v->current_era);
 
-	if (era_snapshot_digest(sn, current_era, bitmap, nr_blocks))
+	if (era_snapshot_digest(v->sn, 1 + v->extent_blocks, bitmap,
+	                        v->nr_blocks))
 	{
 		free(bitmap);
-		goto out_snap;
+		return -1;
 	}
 
 	free(bitmap);
 
+	v->digest_ms = now_ms() - start;
+	start = now_ms();
+
 	/*
 	 * save snapshot superblock
 	 */
 
 	printv(1, "snapshot: write superblock\n");
 
-	ssb = sn->buffer;
+	// all snapshot nodes must be on disk before the superblock
+	if (md_sync(v->sn))
+		return -1;
+
+	ssb = v->sn->buffer;
 
 	memset(ssb, 0, MD_BLOCK_SIZE);
-	memcpy(ssb->uuid, uuid, UUID_LEN);
+	memcpy(ssb->uuid, v->uuid, UUID_LEN);
 
 	ssb->magic = htole64(SNAP_SUPERBLOCK_MAGIC);
-	ssb->version = htole32(1);
+	ssb->version = htole32(SNAP_VERSION);
 
-	ssb->era_size = htole64(era->size);
-	ssb->data_block_size = htole32(chunk);
+	ssb->era_size = htole64(v->era.size);
+	ssb->data_block_size = htole32(v->chunk);
 	ssb->metadata_block_size = htole32(MD_BLOCK_SIZE >> SECTOR_SHIFT);
-	ssb->nr_blocks = htole32(nr_blocks);
-	ssb->snapshot_era = htole32(current_era);
+	ssb->nr_blocks = htole32(v->nr_blocks);
+	ssb->snapshot_era = htole32(v->current_era);
 
-	csum = crc_update(crc_init(), &ssb->flags,
-	                  MD_BLOCK_SIZE - sizeof(uint32_t));
-	ssb->csum = htole32(csum ^ SNAP_SUPERBLOCK_CSUM_XOR);
+	ssb->nr_extents = htole32(v->nr_extents);
+	ssb->extent_blocks = htole32(v->extent_blocks);
+	ssb->bitmap_blocks = htole32(SNAP_BITMAP_BLOCKS(v->nr_blocks));
+	memcpy(ssb->metadata_id, v->metadata_id, UUID_LEN);
 
-	if (md_write(sn, 0, ssb))
-		goto out_snap;
+	csum = (struct md_csum) { ssb, SNAP_SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
 
-	/*
-	 * done
-	 */
+	if (md_write(v->sn, 0, ssb))
+		return -1;
+
+	if (md_sync(v->sn))
+		return -1;
+
+	v->superblock_ms = now_ms() - start;
 
-	md_close(sn);
-	md_close(md);
 	return 0;
+}
 
-out_resume:
-	era_dm_resume(orig->name);
-	era_dm_resume(era->name);
+/*
+ * undo volume_prepare and drop metadata snapshot,
+ * devices are expected to be resumed already
+ */
+static void volume_rollback(struct volume *v)
+{
+	struct device *orig = &v->orig;
+
+	if (v->drop_metadata_snap)
+		era_dm_message0(v->era.name, "drop_metadata_snap");
 
-out_snap_drop:
-	if (drop_metadata_snap)
-		era_dm_message0(era->name, "drop_metadata_snap");
+	if (v->created)
+		era_dm_remove(v->snap.name);
 
-out_snap:
-	era_dm_remove(snap->name);
-	era_dm_remove(cow->name);
+	if (v->cow_created)
+		era_dm_remove(v->cow.name);
 
-	if (replace_with_linear)
+	if (v->replace_with_linear)
 	{
 		strcpy(orig->target, TARGET_LINEAR);
 
 		snprintf(orig->table, sizeof(orig->table),
-		         "%u:%u 0", real_major, real_minor);
+		         "%u:%u 0", v->real_major, v->real_minor);
 
 		if (era_dm_suspend(orig->name))
-			goto out;
+			return;
 
 		era_dm_load(orig->name, 0, orig->size,
 		            orig->target, orig->table, NULL);
 		era_dm_resume(orig->name);
 	}
+}
+
+static void volume_close(struct volume *v)
+{
+	if (v->md)
+		md_close(v->md);
+	if (v->sn)
+		md_close(v->sn);
+	if (v->prev.md)
+		md_close(v->prev.md);
+}
+
+// print string as json string
+static void json_string(const char *str)
+{
+	putchar('"');
+
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+
+		if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+/*
+ * one record per run: phase timings in milliseconds,
+ * metadata i/o and checksum counters
+ */
+static void takesnap_stats(struct volume *vols, unsigned count,
+                           int rc, double total_ms, double suspend_ms)
+{
+	struct md_stats io;
+	unsigned i;
+
+	printf("{\"command\":\"takesnap\",\"result\":\"%s\","
+	       "\"total_ms\":%.3f,\"suspend_ms\":%.3f,"
+	       "\"dm_ioctls\":%u,\"dm_ioctl_ms\":%.3f,"
+	       "\"udev_waits\":%u,\"udev_wait_ms\":%.3f,"
+	       "\"csum_blocks\":%llu,\"crc_engine\":\"%s\","
+	       "\"volumes\":[",
+	       rc ? "error" : "ok", total_ms, suspend_ms,
+	       era_dm_stats.ioctls, era_dm_stats.ioctl_ms,
+	       era_dm_stats.udev_waits, era_dm_stats.udev_ms,
+	       (long long unsigned)md_csum_blocks, crc_engine());
+
+	for (i = 0; i < count; i++)
+	{
+		struct volume *v = &vols[i];
+
+		io = v->io;
+		if (v->md)
+			md_stats_add(&io, &v->md->stats);
+		if (v->sn)
+			md_stats_add(&io, &v->sn->stats);
+
+		printf("%s{\"name\":", i ? "," : "");
+		json_string(v->era.name);
+		printf(",\"snapshot_era\":%u,\"previous_era\":%u,"
+		       "\"prepare_ms\":%.3f,\"copy_ms\":%.3f,"
+		       "\"load_ms\":%.3f,\"bitmap_ms\":%.3f,"
+		       "\"digest_ms\":%.3f,\"superblock_ms\":%.3f,"
+		       "\"extents\":%u,\"snapshot_blocks\":%u,"
+		       "\"reads\":%llu,\"blocks_read\":%llu,"
+		       "\"bytes_read\":%llu,\"writes\":%llu,"
+		       "\"blocks_written\":%llu,\"bytes_written\":%llu,"
+		       "\"cache_hits\":%llu,\"cache_misses\":%llu}",
+		       v->current_era, v->prev.era,
+		       v->prepare_ms, v->copy_ms, v->load_ms,
+		       v->bitmap_ms, v->digest_ms, v->superblock_ms,
+		       v->nr_extents, v->snap_blocks,
+		       (long long unsigned)io.reads,
+		       (long long unsigned)io.blocks_read,
+		       (long long unsigned)io.blocks_read * MD_BLOCK_SIZE,
+		       (long long unsigned)io.writes,
+		       (long long unsigned)io.blocks_written,
+		       (long long unsigned)io.blocks_written * MD_BLOCK_SIZE,
+		       (long long unsigned)io.hits,
+		       (long long unsigned)io.misses);
+	}
+
+	printf("]}\n");
+	fflush(stdout);
+}
+
+/*
+ * takesnap <name> <snapshot-dev> [<name> <snapshot-dev> ...]
+ *
+ * snapshots of all volumes are taken in one suspend cycle, so
+ * they are consistent with each other: metadata of all volumes
+ * is copied in parallel beforehand, then every era and origin
+ * device is suspended, all snapshots activated and all devices
+ * resumed together
+ */
+int era_takesnap(int argc, char **argv)
+{
+	struct volume *vols;
+	double start, suspend_start, deadline;
+	double suspended = 0;
+	uint32_t cookie = 0;
+	unsigned i, j, count;
+	unsigned started;
+	int failed, err;
+	int rc = -1;
+
+	switch (argc)
+	{
+	case 0:
+		error(0, "device name argument expected");
+		usage(stderr, 1);
+	case 1:
+		error(0, "snapshot device argument expected");
+		usage(stderr, 1);
+	default:
+		if (argc % 2)
+		{
+			error(0, "snapshot device argument expected");
+			usage(stderr, 1);
+		}
+	}
+
+	count = argc / 2;
+	start = now_ms();
+
+	vols = calloc(count, sizeof(*vols));
+	if (!vols)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		snprintf(vols[i].era.name, sizeof(vols[i].era.name),
+		         "%s", argv[i * 2]);
+		vols[i].snap_path = argv[i * 2 + 1];
+
+		for (j = 0; j < i; j++)
+		{
+			if (!strcmp(vols[i].era.name, vols[j].era.name) ||
+			    !strcmp(vols[i].snap_path, vols[j].snap_path))
+			{
+				error(0, "duplicate argument: %s %s",
+				      argv[i * 2], argv[i * 2 + 1]);
+				goto out;
+			}
+		}
+	}
+
+	/*
+	 * check devices and take metadata snapshots
+	 */
+
+	for (i = 0; i < count; i++)
+	{
+		double t = now_ms();
+
+		err = volume_prepare(&vols[i]);
+		vols[i].prepare_ms = now_ms() - t;
+
+		if (err)
+			goto out_rollback;
+	}
+
+	for (i = 0; i < count; i++)
+		if (volume_metadata_snap(&vols[i], &vols[i].current_era))
+			goto out_rollback;
+
+	/*
+	 * copy metadata snapshots of all volumes in parallel
+	 */
+
+	for (started = 1; started < count; started++)
+	{
+		err = pthread_create(&vols[started].thread, NULL,
+		                     volume_copy, &vols[started]);
+		if (err)
+		{
+			error(err, "can't create thread");
+			break;
+		}
+	}
+
+	failed = started < count;
+
+	if (!failed)
+		volume_copy(&vols[0]);
+	else
+		vols[0].rc = -1;
+
+	for (i = 1; i < started; i++)
+		pthread_join(vols[i].thread, NULL);
+
+	for (i = 0; i < count; i++)
+		if (vols[i].rc)
+			failed++;
+
+	if (failed)
+		goto out_rollback;
+
+	for (i = 0; i < count; i++)
+		if (volume_drop_metadata_snap(&vols[i]))
+			goto out_rollback;
+
+	for (i = 0; i < count; i++)
+	{
+		double t = now_ms();
+
+		err = volume_load(&vols[i]);
+		vols[i].load_ms = now_ms() - t;
+
+		if (err)
+			goto out_rollback;
+	}
+
+	/*
+	 * suspend all era and origin devices, activate snapshots
+	 */
+
+	suspend_start = now_ms();
+	deadline = suspend_start + max_suspend_ms;
+
+	for (i = 0; i < count; i++)
+	{
+		printv(1, "era: suspend %s\n", vols[i].era.name);
+
+		if (suspend_expired(deadline) ||
+		    era_dm_suspend(vols[i].era.name))
+			goto out_resume;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		printv(1, "origin: suspend %s\n", vols[i].orig.name);
+
+		if (suspend_expired(deadline) ||
+		    era_dm_suspend(vols[i].orig.name))
+			goto out_resume;
+	}
+
+	// resume of the first snapshot commits them
+	if (suspend_expired(deadline))
+		goto out_resume;
+
+	for (i = 0; i < count; i++)
+	{
+		printv(1, "snapshot: resume %s\n", vols[i].snap.name);
+
+		if (era_dm_resume_async(vols[i].snap.name, &cookie))
+			goto out_resume;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		printv(1, "origin: resume %s\n", vols[i].orig.name);
+
+		if (era_dm_resume_async(vols[i].orig.name, &cookie))
+			goto out_resume;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		printv(1, "era: resume %s\n", vols[i].era.name);
+
+		if (era_dm_resume_async(vols[i].era.name, &cookie))
+			goto out_resume;
+	}
+
+	suspended = now_ms() - suspend_start;
+
+	era_dm_wait(cookie);
+	cookie = 0;
+
+	printv(1, "era: suspended for %.0f ms\n", suspended);
+
+	/*
+	 * digest current era and write snapshot superblocks
+	 */
+
+	for (i = 0; i < count; i++)
+		if (volume_finish(&vols[i]))
+			goto out_rollback;
+
+	/*
+	 * done
+	 */
+
+	rc = 0;
+	goto out;
+
+out_resume:
+	if (!suspended)
+		suspended = now_ms() - suspend_start;
+
+	era_dm_wait(cookie);
+
+	for (i = 0; i < count; i++)
+		era_dm_resume(vols[i].orig.name);
+
+	for (i = 0; i < count; i++)
+		era_dm_resume(vols[i].era.name);
+
+out_rollback:
+	for (i = 0; i < count; i++)
+		volume_rollback(&vols[i]);
 
 out:
-	if (snap)
-		free(snap);
-	if (orig)
-		free(orig);
-	if (era)
-		free(era);
-	if (cow)
-		free(cow);
-	if (md)
-		md_close(md);
-	if (sn)
-		md_close(sn);
-	return -1;
+	if (stats == STATS_JSON)
+		takesnap_stats(vols, count, rc, now_ms() - start, suspended);
+
+	for (i = 0; i < count; i++)
+		volume_close(&vols[i]);
+
+	free(vols);
+	return rc;
 }
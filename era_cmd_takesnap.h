@@ -8,8 +8,6 @@
 #define SNAPSHOT_PERSISTENT "N"
 #define SNAPSHOT_CHUNK 16
 
-#define RANDOM_DEVICE "/dev/urandom"
-
 int era_takesnap(int argc, char **argv);
 
 #endif
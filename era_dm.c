@@ -11,6 +11,33 @@
 
 #include <libdevmapper.h>
 
+struct era_dm_stats era_dm_stats;
+
+// timed dm_task_run
+static int _dm_run(struct dm_task *dmt)
+{
+	double start = now_ms();
+	int rc;
+
+	rc = dm_task_run(dmt);
+
+	era_dm_stats.ioctls++;
+	era_dm_stats.ioctl_ms += now_ms() - start;
+
+	return rc;
+}
+
+// timed dm_udev_wait
+static void _dm_wait(uint32_t cookie)
+{
+	double start = now_ms();
+
+	(void) dm_udev_wait(cookie);
+
+	era_dm_stats.udev_waits++;
+	era_dm_stats.udev_ms += now_ms() - start;
+}
+
 void era_dm_init(void)
 {
 	dm_lib_init();
@@ -47,10 +74,10 @@ static int _dm_create(int task, int wait,
 	if (wait && !dm_task_set_cookie(dmt, &cookie, 0))
 		goto out;
 
-	rc = dm_task_run(dmt);
+	rc = _dm_run(dmt);
 
 	if (wait)
-		(void) dm_udev_wait(cookie);
+		_dm_wait(cookie);
 
 	if (rc && info)
 	{
@@ -90,10 +117,10 @@ static int _dm_simple(int task, int wait, const char *name)
 	if (wait && !dm_task_set_cookie(dmt, &cookie, 0))
 		goto out;
 
-	rc = dm_task_run(dmt);
+	rc = _dm_run(dmt);
 
 	if (wait)
-		(void) dm_udev_wait(cookie);
+		_dm_wait(cookie);
 
 	dm_task_destroy(dmt);
 	return rc ? 0 : -1;
@@ -137,6 +164,39 @@ int era_dm_resume(const char *name)
 	return _dm_simple(DM_DEVICE_RESUME, 1, name);
 }
 
+/*
+ * resume without waiting for udev: uevents of several resumes
+ * are collected in one cookie and waited for with era_dm_wait
+ */
+int era_dm_resume_async(const char *name, uint32_t *cookie)
+{
+	struct dm_task *dmt;
+	int rc;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_RESUME)))
+		return -1;
+
+	if (!dm_task_set_name(dmt, name))
+		goto out;
+
+	if (!dm_task_set_cookie(dmt, cookie, 0))
+		goto out;
+
+	rc = _dm_run(dmt);
+
+	dm_task_destroy(dmt);
+	return rc ? 0 : -1;
+out:
+	dm_task_destroy(dmt);
+	return -1;
+}
+
+void era_dm_wait(uint32_t cookie)
+{
+	if (cookie)
+		_dm_wait(cookie);
+}
+
 int era_dm_remove(const char *name)
 {
 	return _dm_simple(DM_DEVICE_REMOVE, 1, name);
@@ -166,7 +226,7 @@ int era_dm_info(const char *name,
 	if (uuid && !dm_task_set_uuid(dmt, uuid))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_run(dmt))
 		goto out;
 
 	if (!dm_task_get_info(dmt, &dmi))
@@ -248,7 +308,7 @@ static int _first_status(int task,
 	if (uuid && !dm_task_set_uuid(dmt, uuid))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_run(dmt))
 		goto out;
 
 	if (!dm_task_get_info(dmt, &dmi))
@@ -334,7 +394,7 @@ int era_dm_message0(const char *name, const char *message)
 	if (!dm_task_set_message(dmt, message))
 		goto out;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_run(dmt))
 		goto out;
 
 	rc = 0;
@@ -352,7 +412,7 @@ int era_dm_list(int (*cb)(void *arg, const char *name), void *cbarg)
 	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
 		return -1;
 
-	if (!dm_task_run(dmt))
+	if (!_dm_run(dmt))
 		goto out;
 
 	if (!(names = dm_task_get_names(dmt)))
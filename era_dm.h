@@ -23,11 +23,23 @@ struct era_dm_info {
 	int32_t target_count;
 };
 
+/* time spent in dm ioctls and udev waits */
+struct era_dm_stats {
+	unsigned ioctls;
+	double ioctl_ms;
+	unsigned udev_waits;
+	double udev_ms;
+};
+
+extern struct era_dm_stats era_dm_stats;
+
 void era_dm_init(void);
 void era_dm_exit(void);
 
 int era_dm_suspend(const char *name);
 int era_dm_resume(const char *name);
+int era_dm_resume_async(const char *name, uint32_t *cookie);
+void era_dm_wait(uint32_t cookie);
 int era_dm_remove(const char *name);
 int era_dm_clear(const char *name);
 
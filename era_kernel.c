@@ -0,0 +1,52 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#include "era_kernel.h"
+
+const void *era_kernel_select(const void *kernels, size_t size,
+                              unsigned count,
+                              int (*check)(const void *kernel))
+{
+	const struct era_kernel *k;
+	unsigned i;
+
+	for (i = 0; i < count - 1; i++)
+	{
+		k = (const void *)((const char *)kernels + size * i);
+
+		if (k->supported() && !check(k))
+			return k;
+	}
+
+	return (const char *)kernels + size * (count - 1);
+}
+
+void era_kernel_check_words(uint64_t *words, unsigned count,
+                            uint64_t *x)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+	{
+		*x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+
+		switch (i % 4)
+		{
+		case 0:
+			words[i] = *x;
+			break;
+		case 1:
+			words[i] = *x & (*x << 7) & (*x >> 5);
+			break;
+		case 2:
+			words[i] = 1ULL << (*x >> 58);
+			break;
+		case 3:
+			words[i] = ~0ULL;
+			break;
+		}
+	}
+
+	words[0] = 0;
+}
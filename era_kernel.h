@@ -0,0 +1,35 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef __ERA_KERNEL_H__
+#define __ERA_KERNEL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * cpu specific kernel: every kernel table entry starts with it,
+ * the best kernel comes first and the last one is the reference
+ */
+struct era_kernel {
+	const char *name;
+	int (*supported)(void);
+};
+
+/*
+ * pick the first supported kernel that passes check(), or the
+ * reference one; not thread safe, run it under pthread_once()
+ */
+const void *era_kernel_select(const void *kernels, size_t size,
+                              unsigned count,
+                              int (*check)(const void *kernel));
+
+/*
+ * fill self-test words: empty, then sparse, dense, single bit
+ * and full words in turn; x is the generator state
+ */
+void era_kernel_check_words(uint64_t *words, unsigned count,
+                            uint64_t *x);
+
+#endif
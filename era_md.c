@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,6 +21,349 @@
 #include "era_md.h"
 #include "era_blk.h"
 
+/*
+ * io_uring backend for metadata reads
+ */
+
+struct md_request {
+	uint64_t  nr;                /* block number */
+	void     *data;              /* destination buffer */
+	unsigned  next;              /* next free request */
+};
+
+struct md_ring {
+	int       fd;                /* io_uring fd */
+	unsigned  entries;           /* submission queue entries */
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void     *sq_ptr;
+	size_t    sq_size;
+	void     *cq_ptr;
+	size_t    cq_size;
+	size_t    sqes_size;
+
+	unsigned  queued;            /* prepared, but not submitted */
+	unsigned  inflight;          /* submitted, but not completed */
+
+	struct md_request *req;      /* requests by sqe user_data */
+	unsigned  free;              /* first free request */
+};
+
+static void md_ring_close(struct md_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	free(ring->req);
+	free(ring);
+}
+
+// set up io_uring, NULL if not available
+static struct md_ring *md_ring_open(unsigned entries)
+{
+	struct io_uring_params p;
+	struct md_ring *ring;
+	unsigned i;
+	void *ptr;
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+	{
+		free(ring);
+		return NULL;
+	}
+
+	ring->entries = p.sq_entries;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto out;
+
+	ring->sq_ptr = ptr;
+	ring->sq_head = ptr + p.sq_off.head;
+	ring->sq_tail = ptr + p.sq_off.tail;
+	ring->sq_mask = ptr + p.sq_off.ring_mask;
+	ring->sq_array = ptr + p.sq_off.array;
+
+	ring->cq_size = p.cq_off.cqes +
+	                p.cq_entries * sizeof(struct io_uring_cqe);
+	ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto out;
+
+	ring->cq_ptr = ptr;
+	ring->cq_head = ptr + p.cq_off.head;
+	ring->cq_tail = ptr + p.cq_off.tail;
+	ring->cq_mask = ptr + p.cq_off.ring_mask;
+	ring->cqes = ptr + p.cq_off.cqes;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto out;
+
+	ring->sqes = ptr;
+
+	ring->req = malloc(sizeof(*ring->req) * ring->entries);
+	if (!ring->req)
+		goto out;
+
+	for (i = 0; i < ring->entries; i++)
+		ring->req[i].next = i + 1;
+
+	ring->free = 0;
+
+	return ring;
+out:
+	md_ring_close(ring);
+	return NULL;
+}
+
+// process completions, returns their number
+static unsigned md_ring_complete(struct md *md)
+{
+	struct md_ring *ring = md->ring;
+	unsigned head, tail, done = 0;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail)
+	{
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		unsigned id = (unsigned)cqe->user_data;
+		struct md_request *req = &ring->req[id];
+
+		if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+		{
+			// IORING_OP_READ is not supported by the kernel
+			if (md_read(md, req->nr, req->data))
+				md->failed++;
+		}
+		else if (cqe->res != MD_BLOCK_SIZE)
+		{
+			error(cqe->res < 0 ? -cqe->res : 0,
+			      "can't read meta-data device: block %llu",
+			      (long long unsigned)req->nr);
+			md->failed++;
+		}
+		else
+		{
+			md->stats.reads++;
+			md->stats.blocks_read++;
+		}
+
+		req->next = ring->free;
+		ring->free = id;
+
+		ring->inflight--;
+		head++;
+		done++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return done;
+}
+
+// io_uring_enter, restarted on EINTR
+static int md_ring_syscall(struct md_ring *ring, unsigned to_submit,
+                           unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int rc;
+
+	do
+		rc = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit,
+		                  min_complete, flags, NULL, 0);
+	while (rc < 0 && errno == EINTR);
+
+	return rc;
+}
+
+/*
+ * submit prepared requests and process completions until at least
+ * min_complete requests are done
+ */
+static int md_ring_enter(struct md *md, unsigned min_complete)
+{
+	struct md_ring *ring = md->ring;
+	unsigned wait, done;
+	int rc;
+
+	if (min_complete > ring->queued + ring->inflight)
+		min_complete = ring->queued + ring->inflight;
+
+	while (ring->queued || min_complete)
+	{
+		// the kernel may take only part of the queue, so only wait
+		// for requests that were in flight before this call
+		wait = min_complete < ring->inflight ?
+		       min_complete : ring->inflight;
+
+		rc = md_ring_syscall(ring, ring->queued, wait);
+
+		// completion queue overflow or kernel short of memory:
+		// reap completions and retry the submit
+		if (rc < 0 && (errno == EAGAIN || errno == EBUSY) &&
+		    ring->inflight)
+			rc = md_ring_syscall(ring, 0, 1);
+
+		if (rc < 0)
+		{
+			error(errno, "io_uring_enter failed");
+			return -1;
+		}
+
+		ring->queued -= (unsigned)rc;
+		ring->inflight += (unsigned)rc;
+
+		done = md_ring_complete(md);
+		min_complete -= done < min_complete ? done : min_complete;
+
+		if (!rc && !done && !wait)
+		{
+			error(0, "io_uring_enter failed: no request submitted");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// queue a read request
+static int md_ring_read(struct md *md, uint64_t nr, void *data)
+{
+	struct md_ring *ring = md->ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx, id;
+
+	// wait for a free slot
+	if (ring->free == ring->entries && md_ring_enter(md, 1))
+		return -1;
+
+	id = ring->free;
+	ring->free = ring->req[id].next;
+	ring->req[id].nr = nr;
+	ring->req[id].data = data;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = md->fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = MD_BLOCK_SIZE;
+	sqe->off = nr * MD_BLOCK_SIZE;
+	sqe->user_data = id;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return 0;
+}
+
+/*
+ * allocate md buffers and cache of at most cache_blocks blocks,
+ * set up io_uring backend
+ */
+static int md_setup(struct md *md, unsigned cache_blocks)
+{
+	unsigned buckets;
+
+	md->buffer = mmap(NULL, MD_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (md->buffer == MAP_FAILED)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
+
+	md->batch = mmap(NULL, MD_BLOCK_SIZE * MD_BATCH_BLOCKS,
+	                 PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (md->batch == MAP_FAILED)
+	{
+		error(ENOMEM, NULL);
+		munmap(md->buffer, MD_BLOCK_SIZE);
+		return -1;
+	}
+
+	/*
+	 * cache: the whole budget is mapped at once,
+	 * pages are allocated on first use
+	 */
+
+	md->cache_blocks = md->blocks < cache_blocks ?
+	                   (unsigned)md->blocks : cache_blocks;
+	if (md->cache_blocks < MD_BATCH_BLOCKS)
+		md->cache_blocks = MD_BATCH_BLOCKS;
+
+	for (buckets = 1; buckets < md->cache_blocks; buckets <<= 1);
+
+	md->cache = mmap(NULL, MD_BLOCK_SIZE * md->cache_blocks,
+	                 PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	md->slots = malloc(sizeof(struct md_slot) * md->cache_blocks);
+	md->hash = malloc(sizeof(unsigned) * buckets);
+
+	if (md->cache == MAP_FAILED || !md->slots || !md->hash)
+	{
+		error(ENOMEM, NULL);
+		if (md->cache != MAP_FAILED)
+			munmap(md->cache, MD_BLOCK_SIZE * md->cache_blocks);
+		free(md->slots);
+		free(md->hash);
+		munmap(md->batch, MD_BLOCK_SIZE * MD_BATCH_BLOCKS);
+		munmap(md->buffer, MD_BLOCK_SIZE);
+		return -1;
+	}
+
+	md->hash_mask = buckets - 1;
+	md->cache_used = 0;
+	memset(&md->stats, 0, sizeof(md->stats));
+	md->parent = NULL;
+
+	md_flush(md);
+
+	md->failed = 0;
+	md->ring = md_ring_open(MD_QUEUE_DEPTH);
+
+	md->wb = NULL;
+	md->wb_nr = 0;
+	md->wb_count = 0;
+
+	return 0;
+}
+
 // open metadata device
 struct md *md_open(const char *device, int rw)
 {
@@ -41,55 +386,150 @@ struct md *md_open(const char *device, int rw)
 
 	md->sectors = sectors;
 	md->blocks = md->sectors / (MD_BLOCK_SIZE >> SECTOR_SHIFT);
+	md->rotational = blkrotational(md->major, md->minor);
 
-	md->buffer = mmap(NULL, MD_BLOCK_SIZE, PROT_READ | PROT_WRITE,
-	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (md->buffer == MAP_FAILED)
+	if (md_setup(md, MD_CACHE_BLOCKS))
 	{
-		error(ENOMEM, NULL);
-		goto out;
+		close(md->fd);
+		free(md);
+		return NULL;
 	}
 
-	md->cache_allocated = 2;
-	md->cache = mmap(NULL, MD_BLOCK_SIZE * 2, PROT_READ | PROT_WRITE,
-	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (md->cache == MAP_FAILED)
+	return md;
+}
+
+/*
+ * open another view of the same metadata device with its own
+ * buffers, cache and io_uring, for use by another thread
+ */
+struct md *md_clone(struct md *orig, unsigned cache_blocks)
+{
+	struct md *md;
+
+	md = malloc(sizeof(struct md));
+	if (!md)
 	{
 		error(ENOMEM, NULL);
-		munmap(md->buffer, MD_BLOCK_SIZE);
-		goto out;
+		return NULL;
 	}
 
-	md->cache_used = 2;
+	md->fd = dup(orig->fd);
+	if (md->fd == -1)
+	{
+		error(errno, "can't duplicate metadata device fd");
+		free(md);
+		return NULL;
+	}
+
+	md->major = orig->major;
+	md->minor = orig->minor;
+	md->sectors = orig->sectors;
+	md->blocks = orig->blocks;
+	md->rotational = orig->rotational;
 
-	md->offset_allocated = 16;
-	md->offset = malloc(md->offset_allocated * sizeof(unsigned));
-	if (!md->offset)
+	if (md_setup(md, cache_blocks))
 	{
-		error(ENOMEM, NULL);
-		munmap(md->cache, MD_BLOCK_SIZE * md->cache_allocated);
-		munmap(md->buffer, MD_BLOCK_SIZE);
-		goto out;
+		close(md->fd);
+		free(md);
+		return NULL;
 	}
 
-	md_flush(md);
+	md->parent = orig;
 
 	return md;
-out:
-	close(md->fd);
-	free(md);
-	return NULL;
+}
+
+/*
+ * md cache: fixed number of slots, hash index
+ * by block number and CLOCK replacement
+ */
+
+#define MD_SLOT_NONE 0xffffffff
+#define MD_NR_NONE   ((uint64_t)-1)
+
+static inline unsigned md_hash(struct md *md, uint64_t nr)
+{
+	return (unsigned)((nr * 0x9e3779b97f4a7c15ULL) >> 32) & md->hash_mask;
+}
+
+// find cached block slot
+static unsigned md_cache_find(struct md *md, uint64_t nr)
+{
+	unsigned slot = md->hash[md_hash(md, nr)];
+
+	while (slot != MD_SLOT_NONE && md->slots[slot].nr != nr)
+		slot = md->slots[slot].next;
+
+	return slot;
+}
+
+static void md_cache_insert(struct md *md, unsigned slot, uint64_t nr)
+{
+	unsigned bucket = md_hash(md, nr);
+
+	md->slots[slot].nr = nr;
+	md->slots[slot].next = md->hash[bucket];
+	md->hash[bucket] = slot;
+}
+
+static void md_cache_remove(struct md *md, unsigned slot)
+{
+	unsigned *p = &md->hash[md_hash(md, md->slots[slot].nr)];
+
+	while (*p != slot)
+		p = &md->slots[*p].next;
+
+	*p = md->slots[slot].next;
+	md->slots[slot].nr = MD_NR_NONE;
+}
+
+// get free slot, evict not recently used block if needed
+static unsigned md_cache_alloc(struct md *md)
+{
+	unsigned slot, i;
+
+	if (md->cache_used < md->cache_blocks)
+	{
+		slot = md->cache_used++;
+		md->slots[slot].nr = MD_NR_NONE;
+		md->slots[slot].pins = 0;
+		md->slots[slot].ref = 0;
+		return slot;
+	}
+
+	for (i = 0; i < md->cache_blocks * 2; i++)
+	{
+		slot = md->clock;
+
+		if (++md->clock == md->cache_blocks)
+			md->clock = 0;
+
+		if (md->slots[slot].pins)
+			continue;
+
+		if (md->slots[slot].ref)
+		{
+			md->slots[slot].ref = 0;
+			continue;
+		}
+
+		if (md->slots[slot].nr != MD_NR_NONE)
+			md_cache_remove(md, slot);
+
+		return slot;
+	}
+
+	error(0, "metadata cache exhausted: all %u blocks are pinned",
+	      md->cache_blocks);
+
+	return MD_SLOT_NONE;
 }
 
 // read, check and cache metadata block
 void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor)
 {
 	struct generic_node *node;
-
-	// most used case: block already in cache
-	if (flags & MD_CACHED && nr < md->offset_allocated &&
-	    md->offset[nr] != 0xffffffff)
-		return md->cache + MD_BLOCK_SIZE * md->offset[nr];
+	unsigned slot;
 
 	// non-cached read
 	if (!(flags & MD_CACHED))
@@ -103,9 +543,9 @@ void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor)
 		// check checksum
 		if (!(flags & MD_NOCRC))
 		{
-			uint32_t csum = crc_update(crc_init(), node->data,
-			                           sizeof(node->data)) ^ xor;
-			if (csum != le32toh(node->csum))
+			struct md_csum v = { node, xor };
+
+			if (md_csum_verify_many(&v, 1) != 1)
 			{
 				error(0, "bad block checksum: %llu",
 				         (long long unsigned)nr);
@@ -116,30 +556,25 @@ void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor)
 		return node;
 	}
 
-	// double cache size
-	if (md->cache_used == md->cache_allocated)
+	// most used case: block already in cache
+	slot = md_cache_find(md, nr);
+	if (slot != MD_SLOT_NONE)
 	{
-		unsigned new_alloc;
-		void *new_cache;
-
-		new_alloc = md->cache_allocated << 1;
-		new_cache = mremap(md->cache,
-		                   md->cache_allocated * MD_BLOCK_SIZE,
-		                   new_alloc * MD_BLOCK_SIZE,
-		                   MREMAP_MAYMOVE);
+		md->stats.hits++;
+		md->slots[slot].ref = 1;
+		if (flags & MD_PIN)
+			md->slots[slot].pins++;
+		return md->cache + MD_BLOCK_SIZE * slot;
+	}
 
-		if (new_cache == MAP_FAILED)
-		{
-			error(errno, "mremap failed");
-			return NULL;
-		}
+	md->stats.misses++;
 
-		md->cache_allocated = new_alloc;
-		md->cache = new_cache;
-	}
+	slot = md_cache_alloc(md);
+	if (slot == MD_SLOT_NONE)
+		return NULL;
 
 	// node cache offset
-	node = md->cache + MD_BLOCK_SIZE * md->cache_used;
+	node = md->cache + MD_BLOCK_SIZE * slot;
 
 	// read block
 	if (md_read(md, nr, node))
@@ -148,9 +583,9 @@ void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor)
 	// check checksum
 	if (!(flags & MD_NOCRC))
 	{
-		uint32_t csum = crc_update(crc_init(), node->data,
-		                           sizeof(node->data)) ^ xor;
-		if (csum != le32toh(node->csum))
+		struct md_csum v = { node, xor };
+
+		if (md_csum_verify_many(&v, 1) != 1)
 		{
 			error(0, "bad block checksum: %llu",
 			         (long long unsigned)nr);
@@ -158,62 +593,160 @@ void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor)
 		}
 	}
 
-	// increase cache offest size
-	if (nr >= md->offset_allocated)
-	{
-		unsigned new_alloc = md->offset_allocated;
-		void *new_offset;
+	// save in cache
+	md_cache_insert(md, slot, nr);
+	md->slots[slot].ref = 1;
+	if (flags & MD_PIN)
+		md->slots[slot].pins++;
+
+	return node;
+}
+
+// release block pinned by md_block
+void md_unpin(struct md *md, void *block)
+{
+	unsigned slot = (unsigned)((block - md->cache) / MD_BLOCK_SIZE);
 
-		while (nr >= new_alloc)
-			new_alloc <<= 1;
+	if (md->slots[slot].pins)
+		md->slots[slot].pins--;
+}
+
+/*
+ * read blocks which are not cached yet into cache in one batch;
+ * blocks with bad checksum are skipped, md_block reports them later
+ */
+int md_prefetch(struct md *md, const uint64_t *nr, unsigned count,
+                uint32_t xor)
+{
+	struct md_csum csums[MD_BATCH_BLOCKS];
+	uint64_t blocks[MD_BATCH_BLOCKS];
+	unsigned slots[MD_BATCH_BLOCKS];
+	unsigned i, n;
+	int rc = 0;
+
+	if (count > MD_BATCH_BLOCKS)
+		count = MD_BATCH_BLOCKS;
+
+	// never take more than a half of the cache
+	if (count > md->cache_blocks / 2)
+		count = md->cache_blocks / 2;
+
+	for (i = 0, n = 0; i < count; i++)
+	{
+		if (nr[i] >= md->blocks)
+			continue;
 
-		new_offset = realloc(md->offset, sizeof(unsigned) * new_alloc);
+		if (md_cache_find(md, nr[i]) != MD_SLOT_NONE)
+			continue;
 
-		if (!new_offset)
+		slots[n] = md_cache_alloc(md);
+		if (slots[n] == MD_SLOT_NONE)
 		{
-			error(ENOMEM, NULL);
-			return NULL;
+			rc = -1;
+			break;
 		}
 
-		md->offset = new_offset;
+		// keep the slot until the read is done
+		md->slots[slots[n]].pins++;
+
+		blocks[n] = nr[i];
+		csums[n].block = md->cache + MD_BLOCK_SIZE * slots[n];
+		csums[n].xor = xor;
 
-		memset(&md->offset[md->offset_allocated], 0xff,
-		       sizeof(unsigned) * (new_alloc - md->offset_allocated));
+		if (md_submit(md, blocks[n], csums[n].block))
+		{
+			md->slots[slots[n]].pins--;
+			rc = -1;
+			break;
+		}
 
-		md->offset_allocated = new_alloc;
+		n++;
 	}
 
-	// save in cache
-	md->offset[nr] = md->cache_used;
-	md->cache_used++;
+	if (md_reap(md))
+		rc = -1;
 
-	return node;
+	for (i = 0; i < n; i++)
+	{
+		md->slots[slots[i]].pins--;
+
+		if (rc || md_csum_verify_many(&csums[i], 1) != 1)
+			continue;
+
+		md_cache_insert(md, slots[i], blocks[i]);
+		md->stats.misses++;
+	}
+
+	return rc;
 }
 
-// flush cached data
+// flush cached data, pinned blocks stay in cache
 void md_flush(struct md *md)
 {
-	if (md->cache_used)
+	unsigned slot;
+
+	memset(md->hash, 0xff, sizeof(unsigned) * (md->hash_mask + 1));
+
+	for (slot = 0; slot < md->cache_used; slot++)
 	{
-		md->cache_used = 0;
-		memset(md->offset, 0xff,
-		       sizeof(unsigned) * md->offset_allocated);
+		struct md_slot *s = &md->slots[slot];
+
+		s->ref = 0;
+
+		if (s->nr == MD_NR_NONE)
+			continue;
+
+		if (s->pins)
+			md_cache_insert(md, slot, s->nr);
+		else
+			s->nr = MD_NR_NONE;
 	}
 }
 
-// close metadata device
-void md_close(struct md *md)
+// close metadata device, fails if queued blocks can't be written
+int md_close(struct md *md)
 {
+	int rc = 0;
+
+	if (md->wb)
+	{
+		rc = md_write_flush(md);
+		munmap(md->wb, MD_BLOCK_SIZE * MD_WB_BLOCKS);
+	}
+
+	if (md->parent)
+		md_stats_add(&md->parent->stats, &md->stats);
+
+	if (md->ring)
+		md_ring_close(md->ring);
 	close(md->fd);
-	munmap(md->cache, md->cache_allocated * MD_BLOCK_SIZE);
+	munmap(md->cache, md->cache_blocks * MD_BLOCK_SIZE);
+	munmap(md->batch, MD_BLOCK_SIZE * MD_BATCH_BLOCKS);
 	munmap(md->buffer, MD_BLOCK_SIZE);
-	free(md->offset);
+	free(md->slots);
+	free(md->hash);
 	free(md);
+
+	return rc;
+}
+
+// accumulate i/o counters
+void md_stats_add(struct md_stats *to, const struct md_stats *from)
+{
+	to->reads += from->reads;
+	to->blocks_read += from->blocks_read;
+	to->writes += from->writes;
+	to->blocks_written += from->blocks_written;
+	to->hits += from->hits;
+	to->misses += from->misses;
 }
 
 // low-level metadata read
 int md_read(struct md *md, uint64_t nr, void *data)
 {
+	if (md->wb_count && md_write_flush(md))
+		return -1;
+
 	if (nr >= md->blocks)
 	{
 		error(0, "can't read meta-data device: "
@@ -231,12 +764,48 @@ int md_read(struct md *md, uint64_t nr, void *data)
 		return -1;
 	}
 
+	md->stats.reads++;
+	md->stats.blocks_read++;
+
+	return 0;
+}
+
+// read count consecutive blocks with one request
+int md_read_blocks(struct md *md, uint64_t nr, unsigned count, void *data)
+{
+	size_t size = (size_t)count * MD_BLOCK_SIZE;
+
+	if (md->wb_count && md_write_flush(md))
+		return -1;
+
+	if (nr >= md->blocks || count > md->blocks - nr)
+	{
+		error(0, "can't read meta-data device: "
+		         "block number exceeds total blocks: "
+		         "%llu >= %llu",
+		         (long long unsigned)(nr + count - 1),
+		         (long long unsigned)md->blocks);
+		return -1;
+	}
+
+	if (pread(md->fd, data, size, nr * MD_BLOCK_SIZE) != size)
+	{
+		error(errno, "can't read meta-data device");
+		return -1;
+	}
+
+	md->stats.reads++;
+	md->stats.blocks_read += count;
+
 	return 0;
 }
 
 // low-level metadata write
 int md_write(struct md *md, uint64_t nr, const void *data)
 {
+	if (md->wb_count && md_write_flush(md))
+		return -1;
+
 	if (nr >= md->blocks)
 	{
 		error(0, "can't write meta-data device: "
@@ -254,5 +823,220 @@ int md_write(struct md *md, uint64_t nr, const void *data)
 		return -1;
 	}
 
+	md->stats.writes++;
+	md->stats.blocks_written++;
+
+	return 0;
+}
+
+// queue block write
+int md_write_behind(struct md *md, uint64_t nr, const void *data)
+{
+	if (nr >= md->blocks)
+	{
+		error(0, "can't write meta-data device: "
+		         "block number exceeds total blocks: "
+		         "%llu >= %llu",
+		         (long long unsigned)nr,
+		         (long long unsigned)md->blocks);
+		return -1;
+	}
+
+	if (!md->wb)
+	{
+		md->wb = mmap(NULL, MD_BLOCK_SIZE * MD_WB_BLOCKS,
+		              PROT_READ | PROT_WRITE,
+		              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (md->wb == MAP_FAILED)
+		{
+			md->wb = NULL;
+			error(ENOMEM, NULL);
+			return -1;
+		}
+	}
+
+	// write out buffer if block does not continue it
+	if (md->wb_count &&
+	    (nr != md->wb_nr + md->wb_count || md->wb_count == MD_WB_BLOCKS))
+		if (md_write_flush(md))
+			return -1;
+
+	if (md->wb_count == 0)
+		md->wb_nr = nr;
+
+	memcpy(md->wb + MD_BLOCK_SIZE * md->wb_count++, data,
+	       MD_BLOCK_SIZE);
+
+	return 0;
+}
+
+// write out queued blocks
+int md_write_flush(struct md *md)
+{
+	size_t size = (size_t)md->wb_count * MD_BLOCK_SIZE;
+
+	if (md->wb_count == 0)
+		return 0;
+
+	// queued blocks are dropped on error, it is not retried
+	md->wb_count = 0;
+
+	if (pwrite(md->fd, md->wb, size,
+	           md->wb_nr * MD_BLOCK_SIZE) != (ssize_t)size)
+	{
+		error(errno, "can't write meta-data device");
+		return -1;
+	}
+
+	md->stats.writes++;
+	md->stats.blocks_written += size / MD_BLOCK_SIZE;
+
+	return 0;
+}
+
+// write out queued blocks and flush device cache
+int md_sync(struct md *md)
+{
+	if (md_write_flush(md))
+		return -1;
+
+	if (fsync(md->fd))
+	{
+		error(errno, "can't sync meta-data device");
+		return -1;
+	}
+
 	return 0;
 }
+
+/*
+ * batched block checksums: up to MD_CSUM_BATCH blocks are
+ * checksummed together, so the crc engine can interleave them
+ */
+
+#define MD_CSUM_BATCH 48
+
+// checksum up to MD_CSUM_BATCH blocks
+static void md_csum_many(const struct md_csum *blocks, unsigned count,
+                         uint32_t *csums)
+{
+	const void *data[MD_CSUM_BATCH];
+	crc_t crc[MD_CSUM_BATCH];
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+	{
+		data[i] = (char *)blocks[i].block + sizeof(__le32);
+		crc[i] = crc_init();
+	}
+
+	crc_update_many(crc, data, MD_BLOCK_SIZE - sizeof(__le32), count);
+
+	for (i = 0; i < count; i++)
+		csums[i] = (uint32_t)crc[i] ^ blocks[i].xor;
+}
+
+uint64_t md_csum_blocks = 0;
+
+// verify checksums, returns number of leading blocks with valid checksum
+unsigned md_csum_verify_many(const struct md_csum *blocks, unsigned count)
+{
+	uint32_t csums[MD_CSUM_BATCH];
+	unsigned done = 0;
+
+	while (done < count)
+	{
+		unsigned i, n = count - done > MD_CSUM_BATCH ?
+		                MD_CSUM_BATCH : count - done;
+
+		md_csum_many(blocks + done, n, csums);
+		__atomic_add_fetch(&md_csum_blocks, n, __ATOMIC_RELAXED);
+
+		for (i = 0; i < n; i++)
+		{
+			struct generic_node *node = blocks[done + i].block;
+			if (csums[i] != le32toh(node->csum))
+				return done + i;
+		}
+
+		done += n;
+	}
+
+	return count;
+}
+
+// calculate and store checksums
+void md_csum_seal_many(const struct md_csum *blocks, unsigned count)
+{
+	uint32_t csums[MD_CSUM_BATCH];
+	unsigned done = 0;
+
+	while (done < count)
+	{
+		unsigned i, n = count - done > MD_CSUM_BATCH ?
+		                MD_CSUM_BATCH : count - done;
+
+		md_csum_many(blocks + done, n, csums);
+		__atomic_add_fetch(&md_csum_blocks, n, __ATOMIC_RELAXED);
+
+		for (i = 0; i < n; i++)
+		{
+			struct generic_node *node = blocks[done + i].block;
+			node->csum = htole32(csums[i]);
+		}
+
+		done += n;
+	}
+}
+
+// queue metadata read
+int md_submit(struct md *md, uint64_t nr, void *data)
+{
+	if (md->wb_count && md_write_flush(md))
+		md->failed++;
+
+	if (nr >= md->blocks)
+		return md_read(md, nr, data);
+
+	if (!md->ring)
+	{
+		if (md_read(md, nr, data))
+			md->failed++;
+		return 0;
+	}
+
+	return md_ring_read(md, nr, data);
+}
+
+// wait for all queued reads
+int md_reap(struct md *md)
+{
+	struct md_ring *ring = md->ring;
+	int failed;
+
+	if (ring && md_ring_enter(md, ring->queued + ring->inflight))
+		return -1;
+
+	failed = md->failed;
+	md->failed = 0;
+
+	return failed ? -1 : 0;
+}
+
+// read count blocks into consecutive buffers
+int md_read_many(struct md *md, const uint64_t *nr, unsigned count,
+                 void *data)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (md_submit(md, nr[i], data + MD_BLOCK_SIZE * i))
+		{
+			md_reap(md);
+			return -1;
+		}
+	}
+
+	return md_reap(md);
+}
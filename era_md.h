@@ -8,10 +8,23 @@
 // md block size
 #define MD_BLOCK_SIZE 4096
 
+// metadata reads kept in flight by the io_uring backend
+#define MD_QUEUE_DEPTH 128
+
+// blocks in the batch read buffer
+#define MD_BATCH_BLOCKS 256
+
+// md cache size limit in blocks (64 MiB)
+#define MD_CACHE_BLOCKS 16384
+
+// write-behind buffer size in blocks (1 MiB)
+#define MD_WB_BLOCKS 256
+
 // md_block read flags
 #define MD_NONE   0x00  // read info buffer
 #define MD_CACHED 0x01  // read into cache
 #define MD_NOCRC  0x02  // don't check crc
+#define MD_PIN    0x04  // pin cached block until md_unpin
 
 /*
  * first 4 bytes in each block is the block checksum:
@@ -22,6 +35,39 @@ struct generic_node {
 	__u8 data[MD_BLOCK_SIZE - sizeof(__le32)];
 } __attribute__ ((packed));
 
+/*
+ * block and its type specific checksum xor value,
+ * used by batched checksum functions
+ */
+struct md_csum {
+	void     *block;
+	uint32_t  xor;
+};
+
+struct md_ring;
+
+/*
+ * md cache slot
+ */
+struct md_slot {
+	uint64_t  nr;                /* cached block number */
+	unsigned  next;              /* next slot in hash chain */
+	unsigned  pins;              /* pin count, pinned slots stay */
+	unsigned  ref;               /* referenced since last clock pass */
+};
+
+/*
+ * metadata i/o counters
+ */
+struct md_stats {
+	uint64_t  reads;             /* read requests */
+	uint64_t  blocks_read;       /* blocks read */
+	uint64_t  writes;            /* write requests */
+	uint64_t  blocks_written;    /* blocks written */
+	uint64_t  hits;              /* cache hits */
+	uint64_t  misses;            /* cache misses */
+};
+
 /*
  * metadata device
  */
@@ -31,15 +77,29 @@ struct md {
 	unsigned  minor;             /* minor device number */
 	uint64_t  sectors;           /* device size */
 	uint64_t  blocks;            /* metadata blocks */
+	int       rotational;        /* seeks are expensive */
 
 	void     *buffer;            /* read buffer for non-cached ops */
+	void     *batch;             /* read buffer for batched ops */
 
 	void     *cache;             /* read buffers for cached ops */
-	unsigned  cache_used;        /* used cache blocks */
-	unsigned  cache_allocated;   /* allocated cache blocks */
+	struct md_slot *slots;       /* cache slots */
+	unsigned  cache_blocks;      /* cache size limit */
+	unsigned  cache_used;        /* slots filled so far */
+	unsigned  clock;             /* clock hand */
 
-	unsigned *offset;            /* cache offsets */
-	unsigned  offset_allocated;  /* cache offsets size */
+	unsigned *hash;              /* hash buckets: first slot in chain */
+	unsigned  hash_mask;         /* buckets - 1 */
+
+	struct md_stats stats;       /* i/o counters */
+	struct md *parent;           /* clone origin, gets stats on close */
+
+	struct md_ring *ring;        /* io_uring backend or NULL */
+	int       failed;            /* submitted read failed */
+
+	void     *wb;                /* write-behind buffer */
+	uint64_t  wb_nr;             /* first block in buffer */
+	unsigned  wb_count;          /* blocks in buffer */
 };
 
 /*
@@ -47,11 +107,51 @@ struct md {
  */
 
 struct md *md_open(const char *device, int rw);
+struct md *md_clone(struct md *md, unsigned cache_blocks);
 void *md_block(struct md *md, int flags, uint64_t nr, uint32_t xor);
+int md_prefetch(struct md *md, const uint64_t *nr, unsigned count,
+                uint32_t xor);
+void md_unpin(struct md *md, void *block);
 void md_flush(struct md *md);
-void md_close(struct md *md);
+int md_close(struct md *md);
 
 int md_read(struct md *md, uint64_t nr, void *data);
+int md_read_blocks(struct md *md, uint64_t nr, unsigned count, void *data);
 int md_write(struct md *md, uint64_t nr, const void *data);
 
+/*
+ * write-behind: consecutive blocks are collected and written
+ * with one request when the run breaks or the buffer is full;
+ * md_sync writes the buffer out and waits for the device.
+ * Writers call md_sync (or md_write_flush) and check it before
+ * md_close, which only reports what is still queued.
+ */
+
+int md_write_behind(struct md *md, uint64_t nr, const void *data);
+int md_write_flush(struct md *md);
+int md_sync(struct md *md);
+
+/*
+ * asynchronous metadata reads: md_submit queues a read of block nr
+ * into data (falls back to synchronous pread without io_uring),
+ * md_reap waits for all submitted reads
+ */
+
+int md_submit(struct md *md, uint64_t nr, void *data);
+int md_reap(struct md *md);
+int md_read_many(struct md *md, const uint64_t *nr, unsigned count,
+                 void *data);
+
+/*
+ * batched block checksums
+ */
+
+unsigned md_csum_verify_many(const struct md_csum *blocks, unsigned count);
+void md_csum_seal_many(const struct md_csum *blocks, unsigned count);
+
+// blocks checksummed by all md instances
+extern uint64_t md_csum_blocks;
+
+void md_stats_add(struct md_stats *to, const struct md_stats *from);
+
 #endif
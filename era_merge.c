@@ -0,0 +1,200 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "era_kernel.h"
+#include "era_merge.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MERGE_HAVE_SIMD 1
+#endif
+
+/*
+ * reference kernel: one step per set bit
+ */
+static void merge_scalar(uint32_t *eras, const uint64_t *words,
+                         unsigned count, uint32_t era)
+{
+	unsigned i, chunk;
+	uint64_t val;
+
+	for (i = 0; i < count; i++)
+	{
+		for (val = words[i]; val; val &= val - 1)
+		{
+			chunk = i * 64 + __builtin_ctzll(val);
+
+			if (eras[chunk] < era)
+				eras[chunk] = era;
+		}
+	}
+}
+
+#ifdef MERGE_HAVE_SIMD
+
+/*
+ * avx2 kernel: writeset words with few set bits on average are
+ * merged by the scalar kernel, one step per bit is less work
+ * than a word. Otherwise words without set bits are skipped and
+ * the rest are merged whole: 64 eras in 8 vectors, lane masks
+ * are the word bits shifted to the sign bit
+ */
+
+// average set bits per word up to which scalar kernel is used
+#define MERGE_SPARSE_BITS 4
+
+// words counted for the average, spread over all words
+#define MERGE_SAMPLES 256
+
+__attribute__((target("avx2")))
+static void merge_avx2_words(uint32_t *eras, const uint64_t *words,
+                             unsigned count, uint32_t era)
+{
+	const __m256i shift = _mm256_setr_epi32(31, 30, 29, 28,
+	                                        27, 26, 25, 24);
+	const __m256i e = _mm256_set1_epi32(era);
+	__m256i m, v;
+	unsigned i, k;
+	uint64_t val;
+	uint32_t *p;
+
+	for (i = 0; i < count; i++)
+	{
+		val = words[i];
+		if (!val)
+			continue;
+
+		p = eras + i * 64;
+
+		for (k = 0; k < 64; k += 8)
+		{
+			m = _mm256_set1_epi32((uint32_t)(val >> k));
+			m = _mm256_srai_epi32(_mm256_sllv_epi32(m, shift), 31);
+
+			v = _mm256_loadu_si256((__m256i *)(p + k));
+			v = _mm256_max_epu32(v, _mm256_and_si256(m, e));
+			_mm256_storeu_si256((__m256i *)(p + k), v);
+		}
+	}
+}
+
+__attribute__((target("popcnt")))
+static void merge_avx2(uint32_t *eras, const uint64_t *words,
+                       unsigned count, uint32_t era)
+{
+	unsigned i, step, samples = 0;
+	uint64_t bits = 0;
+
+	step = count > MERGE_SAMPLES ? count / MERGE_SAMPLES : 1;
+
+	for (i = 0; i < count; i += step, samples++)
+		bits += __builtin_popcountll(words[i]);
+
+	if (bits <= (uint64_t)samples * MERGE_SPARSE_BITS)
+		merge_scalar(eras, words, count, era);
+	else
+		merge_avx2_words(eras, words, count, era);
+}
+
+static int merge_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") &&
+	       __builtin_cpu_supports("popcnt");
+}
+
+#endif
+
+static int merge_always(void)
+{
+	return 1;
+}
+
+/*
+ * available kernels, the best one first
+ */
+struct merge_kernel {
+	struct era_kernel kernel;
+	mergefn_t merge;
+};
+
+static const struct merge_kernel merge_kernels[] = {
+#ifdef MERGE_HAVE_SIMD
+	{ { "avx2",   merge_have_avx2  }, merge_avx2   },
+#endif
+	{ { "scalar", merge_always     }, merge_scalar },
+};
+
+#define MERGE_KERNELS (sizeof(merge_kernels) / sizeof(merge_kernels[0]))
+
+// words used by kernel self-test
+#define MERGE_CHECK_WORDS 16
+
+/*
+ * check kernel against the reference one: sparse,
+ * dense and mixed words, eras below and above merged one
+ */
+static int merge_check(const void *kernel)
+{
+	const struct merge_kernel *k = kernel;
+	uint32_t expected[MERGE_CHECK_WORDS * 64];
+	uint32_t eras[MERGE_CHECK_WORDS * 64];
+	uint64_t words[MERGE_CHECK_WORDS];
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	unsigned i;
+
+	era_kernel_check_words(words, MERGE_CHECK_WORDS, &x);
+
+	for (i = 0; i < MERGE_CHECK_WORDS * 64; i++)
+	{
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		eras[i] = x >> 63 ? 0xfffffff0u : (uint32_t)(x >> 40) % 100;
+		expected[i] = eras[i];
+	}
+
+	merge_scalar(expected, words, MERGE_CHECK_WORDS, 50);
+	merge_scalar(expected, words, MERGE_CHECK_WORDS, 0xfffffff8u);
+	k->merge(eras, words, MERGE_CHECK_WORDS, 50);
+	k->merge(eras, words, MERGE_CHECK_WORDS, 0xfffffff8u);
+
+	return memcmp(eras, expected, sizeof(eras)) ? -1 : 0;
+}
+
+static pthread_once_t merge_once = PTHREAD_ONCE_INIT;
+static const struct merge_kernel *merge_selected;
+
+// pick the best supported kernel that passes the self-test
+static void merge_select(void)
+{
+	merge_selected = era_kernel_select(merge_kernels,
+	                                   sizeof(merge_kernels[0]),
+	                                   MERGE_KERNELS, merge_check);
+}
+
+void era_merge(uint32_t *eras, const uint64_t *words,
+               unsigned count, uint32_t era)
+{
+	pthread_once(&merge_once, merge_select);
+	merge_selected->merge(eras, words, count, era);
+}
+
+const char *era_merge_kernel(unsigned i, mergefn_t *merge)
+{
+	const struct merge_kernel *k;
+
+	if (i >= MERGE_KERNELS)
+		return NULL;
+
+	k = &merge_kernels[i];
+	*merge = k->kernel.supported() && !merge_check(k) ?
+	         k->merge : NULL;
+
+	return k->kernel.name;
+}
@@ -0,0 +1,25 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef __ERA_MERGE_H__
+#define __ERA_MERGE_H__
+
+/*
+ * writeset merge: eras[i] = max(eras[i], era) for every bit i
+ * set in words; eras must hold count * 64 entries
+ */
+void era_merge(uint32_t *eras, const uint64_t *words,
+               unsigned count, uint32_t era);
+
+typedef void (*mergefn_t) (uint32_t *eras, const uint64_t *words,
+                           unsigned count, uint32_t era);
+
+/*
+ * merge kernels for bench/merge_bench.c: name of kernel i, NULL
+ * past the last one; merge is NULL if the cpu does not support
+ * the kernel or it fails the self-test
+ */
+const char *era_merge_kernel(unsigned i, mergefn_t *merge);
+
+#endif
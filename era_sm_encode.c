@@ -0,0 +1,220 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "era_kernel.h"
+#include "era_sm_encode.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ENCODE_HAVE_BMI2 1
+#endif
+
+// output of one word: entries of low and high 32 bits
+static inline void encode_store(void *bytes, uint64_t lo, uint64_t hi)
+{
+	lo = htole64(lo);
+	hi = htole64(hi);
+
+	memcpy(bytes, &lo, sizeof(lo));
+	memcpy(bytes + sizeof(lo), &hi, sizeof(hi));
+}
+
+/*
+ * reference kernel: one step per set bit
+ */
+static unsigned encode_scalar(void *bytes, const uint64_t *words,
+                              unsigned count)
+{
+	uint64_t out[2], val;
+	unsigned i, bit, total = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		out[0] = out[1] = 0;
+
+		for (val = words[i]; val; val &= val - 1)
+		{
+			bit = __builtin_ctzll(val);
+			out[bit / 32] |= 1ULL << ((bit % 32) * 2 + 1);
+			total++;
+		}
+
+		encode_store(bytes + i * 16, out[0], out[1]);
+	}
+
+	return total;
+}
+
+/*
+ * table kernel: every byte is spread to 16 bits by lookup
+ */
+
+static uint16_t encode_table[256];
+
+// fill the table, run once before kernel selection
+static void encode_table_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++)
+	{
+		uint16_t v = 0;
+
+		for (k = 0; k < 8; k++)
+			if (i & (1 << k))
+				v |= 1 << (k * 2 + 1);
+
+		encode_table[i] = v;
+	}
+}
+
+static inline uint64_t spread32_table(uint32_t val)
+{
+	return (uint64_t)encode_table[val & 0xff] |
+	       (uint64_t)encode_table[(val >> 8) & 0xff] << 16 |
+	       (uint64_t)encode_table[(val >> 16) & 0xff] << 32 |
+	       (uint64_t)encode_table[val >> 24] << 48;
+}
+
+static unsigned encode_lut(void *bytes, const uint64_t *words,
+                           unsigned count)
+{
+	unsigned i, total = 0;
+	uint64_t val;
+
+	for (i = 0; i < count; i++)
+	{
+		val = words[i];
+
+		encode_store(bytes + i * 16, spread32_table((uint32_t)val),
+		             spread32_table((uint32_t)(val >> 32)));
+		total += __builtin_popcountll(val);
+	}
+
+	return total;
+}
+
+#ifdef ENCODE_HAVE_BMI2
+
+/*
+ * bmi2 kernel: pdep deposits 32 bits to odd bit positions
+ */
+__attribute__((target("bmi2,popcnt")))
+static unsigned encode_bmi2(void *bytes, const uint64_t *words,
+                            unsigned count)
+{
+	const uint64_t odd = 0xaaaaaaaaaaaaaaaaULL;
+	unsigned i, total = 0;
+	uint64_t val;
+
+	for (i = 0; i < count; i++)
+	{
+		val = words[i];
+
+		encode_store(bytes + i * 16, _pdep_u64(val, odd),
+		             _pdep_u64(val >> 32, odd));
+		total += __builtin_popcountll(val);
+	}
+
+	return total;
+}
+
+static int encode_have_bmi2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("bmi2") &&
+	       __builtin_cpu_supports("popcnt");
+}
+
+#endif
+
+static int encode_always(void)
+{
+	return 1;
+}
+
+/*
+ * available kernels, the best one first
+ */
+struct encode_kernel {
+	struct era_kernel kernel;
+	unsigned (*encode)(void *bytes, const uint64_t *words,
+	                   unsigned count);
+};
+
+static const struct encode_kernel encode_kernels[] = {
+#ifdef ENCODE_HAVE_BMI2
+	{ { "bmi2",   encode_have_bmi2 }, encode_bmi2   },
+#endif
+	{ { "table",  encode_always    }, encode_lut    },
+	{ { "scalar", encode_always    }, encode_scalar },
+};
+
+#define ENCODE_KERNELS (sizeof(encode_kernels) / sizeof(encode_kernels[0]))
+
+// words used by kernel self-test
+#define ENCODE_CHECK_WORDS 16
+
+/*
+ * check kernel against the reference one:
+ * sparse, dense, single bit and empty words
+ */
+static int encode_check(const void *kernel)
+{
+	const struct encode_kernel *k = kernel;
+	unsigned char expected[ENCODE_CHECK_WORDS * 16];
+	unsigned char bytes[ENCODE_CHECK_WORDS * 16];
+	uint64_t words[ENCODE_CHECK_WORDS];
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+	era_kernel_check_words(words, ENCODE_CHECK_WORDS, &x);
+
+	if (k->encode(bytes, words, ENCODE_CHECK_WORDS) !=
+	    encode_scalar(expected, words, ENCODE_CHECK_WORDS))
+		return -1;
+
+	return memcmp(bytes, expected, sizeof(bytes)) ? -1 : 0;
+}
+
+static pthread_once_t encode_once = PTHREAD_ONCE_INIT;
+static const struct encode_kernel *encode_selected;
+
+// pick the best supported kernel that passes the self-test
+static void encode_select(void)
+{
+	encode_table_init();
+
+	encode_selected = era_kernel_select(encode_kernels,
+	                                    sizeof(encode_kernels[0]),
+	                                    ENCODE_KERNELS, encode_check);
+}
+
+unsigned era_sm_encode(void *bytes, const uint64_t *words,
+                       unsigned nr_bits)
+{
+	unsigned count = nr_bits / 64;
+	unsigned total;
+	uint64_t last;
+
+	pthread_once(&encode_once, encode_select);
+
+	total = encode_selected->encode(bytes, words, count);
+
+	// drop bits past the end of the last word
+	if (nr_bits % 64)
+	{
+		last = words[count] & ((1ULL << (nr_bits % 64)) - 1);
+		total += encode_selected->encode(bytes + count * 16,
+		                                 &last, 1);
+	}
+
+	return total;
+}
@@ -0,0 +1,18 @@
+/*
+ * This file is released under the GPL.
+ */
+
+#ifndef __ERA_SM_ENCODE_H__
+#define __ERA_SM_ENCODE_H__
+
+/*
+ * spacemap bitmap encoding: every bit of words becomes two-bit
+ * entry with ref count 1 or 0, entry k is bits 2k, 2k+1 of bytes
+ * (high and low bits swapped on disk, so set bit goes to 2k+1);
+ * bits past nr_bits are dropped, 16 bytes are written for every
+ * word started, returns number of set bits
+ */
+unsigned era_sm_encode(void *bytes, const uint64_t *words,
+                       unsigned nr_bits);
+
+#endif
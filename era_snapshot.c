@@ -4,17 +4,19 @@
 
 #define _GNU_SOURCE
 
+#include <sys/mman.h>
 #include <endian.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 
-#include "crc32c.h"
 #include "bitmap.h"
 #include "era.h"
 #include "era_md.h"
 #include "era_btree.h"
+#include "era_merge.h"
+#include "era_spacemap.h"
 #include "era_snapshot.h"
 
 int era_ssb_check(struct era_snapshot_superblock *ssb)
@@ -30,7 +32,7 @@ int era_ssb_check(struct era_snapshot_superblock *ssb)
 	}
 
 	version = le32toh(ssb->version);
-	if (version != SNAP_VERSION)
+	if (version < SNAP_MIN_VERSION || version > SNAP_VERSION)
 	{
 		error(0, "unsupported snapshot version: %d", version);
 		return -1;
@@ -41,22 +43,8 @@ int era_ssb_check(struct era_snapshot_superblock *ssb)
 
 struct writeset {
 	unsigned era;
-	uint64_t root;
 	unsigned nr_bits;
-	unsigned long *bitmap;
-};
-
-struct writesets_find {
-	unsigned find_era;
-	uint32_t found_bits;
-	uint64_t found_root;
-};
-
-struct writesets_state {
-	unsigned total;
-	unsigned maximum;
-	struct writeset *ws;
-	struct md *md;
+	uint64_t root;
 };
 
 struct bitset_state {
@@ -65,197 +53,370 @@ struct bitset_state {
 	unsigned long *bitmap;
 };
 
-struct array_state {
-	struct md *sn;
-	uint64_t nr;
-	unsigned curr;
-	unsigned total;
-	unsigned maximum;
-	unsigned ws_total;
-	struct writeset *ws;
-};
+/*
+ * bitset leaves are visited by parallel walk,
+ * each leaf owns its own range of bitmap words
+ */
 
-static int bitset_cb(void *arg, unsigned size, void *dummy, void *data)
+static int bitset_cb(void *arg, uint64_t index, unsigned size,
+                     void *keys, void *data)
 {
 	struct bitset_state *state = arg;
 	uint64_t *values = data;
-	unsigned i, j;
+	unsigned i, total = 0;
 
 	for (i = 0; i < size; i++)
 	{
+		uint64_t bit = (index + i) * 64;
 		uint64_t val = le64toh(values[i]);
+		unsigned bits;
+
+		if (bit >= state->maximum)
+			break;
+
+		bits = state->maximum - bit < 64 ?
+		       (unsigned)(state->maximum - bit) : 64;
+		total += bits;
 
-		if (val == 0)
+		if (bits < 64)
+			val &= (1ULL << bits) - 1;
+
+		while (val)
 		{
-			state->total = state->total + 64 > state->maximum ?
-			               state->maximum : state->total + 64;
-			continue;
+			set_bit(bit + __builtin_ctzll(val), state->bitmap);
+			val &= val - 1;
 		}
+	}
 
-		for (j = 0; j < 64; j++)
-		{
-			if (state->total >= state->maximum)
-				return 0;
+	__atomic_add_fetch(&state->total, total, __ATOMIC_RELAXED);
+	return 0;
+}
 
-			if ((val >> j) & 1)
-				set_bit(state->total++, state->bitmap);
-			else
-				state->total++;
-		}
+struct array_state {
+	unsigned era;
+	unsigned total;
+	unsigned maximum;
+	unsigned long *bitmap;
+};
+
+/*
+ * marks chunks of era or later in bitmap, array leaves
+ * do not end on word boundary, so bits are set atomically
+ */
+static int array_cb(void *arg, uint64_t index, unsigned size,
+                    void *keys, void *data)
+{
+	struct array_state *state = arg;
+	__le32 *values = data;
+	unsigned i, total = 0;
+
+	for (i = 0; i < size && index + i < state->maximum; i++)
+	{
+		if (le32toh(values[i]) >= state->era)
+			test_and_set_bit_atomic(index + i, state->bitmap);
+		total++;
 	}
 
+	__atomic_add_fetch(&state->total, total, __ATOMIC_RELAXED);
 	return 0;
 }
 
-static int writesets_cb(void *arg, unsigned size, void *keys, void *values)
+/*
+ * read writesets tree, writesets come in ascending era
+ */
+static int writesets_read(struct md *md, uint64_t root,
+                          struct writeset **writesets, unsigned *count)
 {
-	struct writesets_state *state = arg;
-	struct era_writeset *ews = values;
-	uint64_t *eras = keys;
-	struct writeset *ws;
-	unsigned i, offset;
+	struct writeset *ws = NULL, *p;
+	struct era_writeset *ews;
+	struct era_cursor *c;
+	unsigned i, size, total = 0;
+	uint64_t index;
+	__le64 *eras;
+	void *keys, *values;
+	int rc;
+
+	c = era_cursor_open(md, root, LEAF_WRITESET);
+	if (!c)
+		return -1;
 
-	if (size == 0)
-		return 0;
+	while ((rc = era_cursor_next(c, &index, &size, &keys, &values)) == 1)
+	{
+		p = realloc(ws, sizeof(*ws) * (total + size));
+		if (!p)
+		{
+			error(ENOMEM, NULL);
+			rc = -1;
+			break;
+		}
 
-	offset = state->total;
-	ws = realloc(state->ws, sizeof(*ws) * (offset + size));
+		ws = p;
+		eras = keys;
+		ews = values;
+
+		for (i = 0; i < size; i++)
+		{
+			ws[total + i].era = (unsigned)le64toh(eras[i]);
+			ws[total + i].nr_bits = le32toh(ews[i].nr_bits);
+			ws[total + i].root = le64toh(ews[i].root);
+		}
 
-	if (!ws)
+		total += size;
+	}
+
+	era_cursor_close(c);
+
+	if (rc)
 	{
-		error(ENOMEM, NULL);
+		free(ws);
 		return -1;
 	}
 
-	state->ws = ws;
-	state->total += size;
+	*writesets = ws;
+	*count = total;
+	return 0;
+}
 
-	for (i = 0; i < size; i++)
+/*
+ * seal and write count consecutive snapshot blocks starting at block nr
+ */
+static int snapshot_write(struct md *sn, uint64_t nr, void *blocks,
+                          unsigned count, uint32_t xor)
+{
+	struct md_csum csums[SNAP_BATCH] = { { NULL, 0 } };
+	unsigned i;
+
+	for (i = 0; i < count; i++)
 	{
-		ws[offset + i].era = (unsigned)le64toh(eras[i]);
-		ws[offset + i].root = le64toh(ews[i].root);
-		ws[offset + i].nr_bits = le32toh(ews[i].nr_bits);
-		ws[offset + i].bitmap = NULL;
+		struct era_snapshot_node *node = blocks + MD_BLOCK_SIZE * i;
+
+		node->blocknr = htole64(nr + i);
+		node->flags = 0;
+
+		csums[i].block = node;
+		csums[i].xor = xor;
 	}
 
-	for (i = offset; i < offset + size; i++)
+	md_csum_seal_many(csums, count);
+
+	for (i = 0; i < count; i++)
+		if (md_write_behind(sn, nr + i, blocks + MD_BLOCK_SIZE * i))
+			return -1;
+
+	return 0;
+}
+
+/*
+ * read and check count (up to SNAP_BATCH) snapshot blocks from block nr
+ */
+static int snapshot_read(struct md *sn, uint64_t nr, void *blocks,
+                         unsigned count, uint32_t xor)
+{
+	struct md_csum csums[SNAP_BATCH];
+	struct era_snapshot_node *node;
+	unsigned i, bad;
+
+	if (md_read_blocks(sn, nr, count, blocks))
+		return -1;
+
+	for (i = 0; i < count; i++)
+	{
+		csums[i].block = blocks + MD_BLOCK_SIZE * i;
+		csums[i].xor = xor;
+	}
+
+	bad = md_csum_verify_many(csums, count);
+	if (bad != count)
 	{
-		unsigned bits = ws[i].nr_bits;
-		uint64_t root = ws[i].root;
-		struct bitset_state bst;
+		error(0, "bad snapshot block checksum: %llu",
+		      (long long unsigned)(nr + bad));
+		return -1;
+	}
 
-		ws[i].bitmap = malloc(sizeof(long) * LONGS(bits));
+	for (i = 0; i < count; i++)
+	{
+		node = blocks + MD_BLOCK_SIZE * i;
 
-		if (!ws[i].bitmap)
+		if (le64toh(node->blocknr) != nr + i)
 		{
-			error(ENOMEM, NULL);
+			error(0, "bad snapshot block: %llu",
+			      (long long unsigned)(nr + i));
 			return -1;
 		}
+	}
+
+	return 0;
+}
 
-		memset(ws[i].bitmap, 0, sizeof(long) * LONGS(bits));
+// 64-bit word w of bitmap made of longs total longs
+static uint64_t bitmap_word(const unsigned long *bitmap,
+                            unsigned long longs, unsigned long w)
+{
+	uint64_t word;
 
-		bst = (struct bitset_state) {
-			.total = 0,
-			.maximum = state->maximum,
-			.bitmap = ws[i].bitmap,
-		};
+	if (BITS_PER_LONG == 64)
+		return bitmap[w];
 
-		if (era_bitset_walk(state->md, root,
-		                    bitset_cb, &bst, NULL, NULL) == -1)
-			return -1;
+	word = bitmap[w * 2];
+	if (w * 2 + 1 < longs)
+		word |= (uint64_t)bitmap[w * 2 + 1] << 32;
+
+	return word;
+}
+
+static void bitmap_set_word(unsigned long *bitmap, unsigned long longs,
+                            unsigned long w, uint64_t word)
+{
+	if (BITS_PER_LONG == 64)
+	{
+		bitmap[w] = word;
+		return;
 	}
 
-	return 0;
+	bitmap[w * 2] = (unsigned long)word;
+	if (w * 2 + 1 < longs)
+		bitmap[w * 2 + 1] = (unsigned long)(word >> 32);
 }
 
-static int snapshot_write(struct md *sn, uint64_t nr,
-                          struct era_snapshot_node *node)
+/*
+ * extent writer: runs of equal eras are collected into extent
+ * blocks starting at block 1, SNAP_BATCH blocks are sealed and
+ * written at once
+ */
+struct extent_writer {
+	struct md *sn;
+	void *batch;
+	uint64_t nr;       // block number of batch start
+	unsigned used;     // full blocks in batch
+	unsigned count;    // extents in current block
+	unsigned total;    // extents written
+
+	// open run
+	unsigned start;
+	unsigned length;
+	unsigned era;
+};
+
+static int extent_emit(struct extent_writer *w)
 {
-	uint32_t csum;
+	struct era_snapshot_extents *block;
+	struct era_snapshot_extent *ext;
+
+	block = w->batch + MD_BLOCK_SIZE * w->used;
+	ext = &block->extent[w->count++];
 
-	node->blocknr = htole64(nr);
-	node->flags = 0;
+	ext->start = htole32(w->start);
+	ext->length = htole32(w->length);
+	ext->era = htole32(w->era);
+	block->nr_extents = htole32(w->count);
+	w->total++;
 
-	csum = crc_update(crc_init(), &node->flags,
-	                  MD_BLOCK_SIZE - sizeof(node->csum));
-	node->csum = htole32(csum ^ SNAP_ARRAY_CSUM_XOR);
+	if (w->count < EXTENTS_PER_BLOCK)
+		return 0;
 
-	if (md_write(sn, nr, node))
+	w->count = 0;
+	if (++w->used < SNAP_BATCH)
+		return 0;
+
+	if (snapshot_write(w->sn, w->nr, w->batch, SNAP_BATCH,
+	                   SNAP_EXTENT_CSUM_XOR))
 		return -1;
 
+	w->nr += SNAP_BATCH;
+	w->used = 0;
+	memset(w->batch, 0, MD_BLOCK_SIZE * SNAP_BATCH);
+
 	return 0;
 }
 
-static int array_cb(void *arg, unsigned size, void *dummy, void *data)
+// append eras of count chunks from chunk start on
+static int extent_add(struct extent_writer *w, unsigned start,
+                      const uint32_t *eras, unsigned count)
 {
-	struct array_state *state = arg;
-	struct era_snapshot_node *node;
-	__le32 *eras = data;
-	unsigned i;
-
-	node = state->sn->buffer;
-
-	if (state->total == 0)
-		memset(node, 0, MD_BLOCK_SIZE);
-
-	if (size == 0)
-		return state->curr == 0 ? 0 :
-		       snapshot_write(state->sn, state->nr, node);
+	unsigned i, j;
 
-	for (i = 0; i < size; i++)
+	for (i = 0; i < count; i = j)
 	{
-		unsigned era;
+		for (j = i + 1; j < count && eras[j] == eras[i]; j++);
 
-		if (state->curr == ERAS_PER_BLOCK)
+		if (w->length && w->era == eras[i])
 		{
-			if (snapshot_write(state->sn, state->nr, node))
-				return -1;
-
-			state->nr++;
-			state->curr = 0;
-			memset(node, 0, MD_BLOCK_SIZE);
+			w->length += j - i;
+			continue;
 		}
 
-		if (state->total >= state->maximum)
-			return 0;
-
-		era = le32toh(eras[i]);
+		if (w->length && extent_emit(w))
+			return -1;
 
-		if (state->ws_total > 0)
-		{
-			unsigned long offset = state->total / BITS_PER_LONG;
-			unsigned long sh = state->total & (BITS_PER_LONG - 1);
-			unsigned j;
+		w->start = start + i;
+		w->length = j - i;
+		w->era = eras[i];
+	}
 
-			for (j = 0; j < state->ws_total; j++)
-			{
-				if (state->total >= state->ws[j].nr_bits)
-					continue;
+	return 0;
+}
 
-				if (!((state->ws[j].bitmap[offset] >> sh) & 1))
-					continue;
+// close open run and write out the rest of extent blocks
+static int extent_finish(struct extent_writer *w)
+{
+	if (w->length && extent_emit(w))
+		return -1;
 
-				if (state->ws[j].era > era)
-					era = state->ws[j].era;
-			}
-		}
+	w->length = 0;
 
-		node->era[state->curr] = htole32(era);
-		state->total++;
-		state->curr++;
+	if (w->count)
+	{
+		w->used++;
+		w->count = 0;
 	}
 
+	if (w->used && snapshot_write(w->sn, w->nr, w->batch, w->used,
+	                              SNAP_EXTENT_CSUM_XOR))
+		return -1;
+
+	w->nr += w->used;
+	w->used = 0;
+
 	return 0;
 }
 
-int era_snapshot_copy(struct md *md, struct md *sn,
-                      uint64_t superblock, unsigned entries)
+/*
+ * copy era_array to snapshot merging all writesets in
+ *
+ * chunk space is processed in windows of SNAP_WINDOW chunks:
+ * era_array values and bitset words of the window are read,
+ * set bits of each writeset raise eras of their chunks and
+ * eras of the window are appended to extents as runs. Memory
+ * use depends on window size only, neither on device size nor
+ * on writesets.
+ *
+ * With previous snapshot of the same device (prev) eras of the
+ * window come from it instead of era_array, and only writesets
+ * of its era and later ones are merged in: writes after that
+ * snapshot were done in its era or later eras. Writesets are
+ * digested into era_array oldest first, so all of them are
+ * still in the tree while writeset of that era is. Era numbers
+ * start over when metadata is recreated, so prev must be taken
+ * from the same metadata (same metadata id); otherwise full
+ * copy is done. The id is returned in metadata_id, zero if
+ * metadata has none.
+ */
+int era_snapshot_copy(struct md *md, struct md *sn, struct md *prev,
+                      uint64_t superblock, unsigned entries,
+                      unsigned *nr_extents, unsigned *extent_blocks,
+                      void *metadata_id)
 {
-	struct array_state ast;
-	struct writesets_state wst;
 	struct era_superblock *sb;
+	struct era_snapshot_reader *r = NULL;
+	struct extent_writer w;
+	const void *id;
+	struct writeset *ws = NULL;
 	uint64_t writeset_tree_root;
 	uint64_t era_array_root;
+	unsigned i, ws_total = 0, prev_era = 0;
+	unsigned start, count, bits, nr_words;
+	uint32_t *eras = NULL;
+	uint64_t *words = NULL;
 	int rc = -1;
 
 	sb = md_block(md, MD_CACHED, superblock, SUPERBLOCK_CSUM_XOR);
@@ -264,133 +425,585 @@ int era_snapshot_copy(struct md *md, struct md *sn,
 
 	era_array_root = le64toh(sb->era_array_root);
 	writeset_tree_root = le64toh(sb->writeset_tree_root);
+	id = era_metadata_id(sb);
+	memcpy(metadata_id, id ? id : empty_block, UUID_LEN);
 
-	/*
-	 * read writesets and all bisets
-	 */
-
-	wst = (struct writesets_state) {
-		.total = 0,
-		.md = md,
-		.ws = NULL,
-		.maximum = entries,
-	};
+	memset(&w, 0, sizeof(w));
+	w.sn = sn;
+	w.nr = 1;
 
-	md_flush(md);
+	w.batch = mmap(NULL, MD_BLOCK_SIZE * SNAP_BATCH,
+	               PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (w.batch == MAP_FAILED)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
 
-	if (era_writesets_walk(md, writeset_tree_root,
-	                       writesets_cb, &wst, NULL, NULL))
+	if (writesets_read(md, writeset_tree_root, &ws, &ws_total))
 		goto out;
 
-	/*
-	 * copy era_array
-	 */
+	if (prev)
+	{
+		r = era_snapshot_open(prev);
+		if (!r)
+			goto out;
 
-	ast = (struct array_state) {
-		.sn = sn,
-		.nr = 1, // first free block after superblock
-		.curr = 0,
-		.total = 0,
-		.maximum = entries,
-		.ws_total = wst.total,
-		.ws = wst.ws,
-	};
+		prev_era = era_snapshot_era(r);
 
-	md_flush(md);
+		for (i = 0; i < ws_total; i++)
+			if (ws[i].era == prev_era)
+				break;
 
-	if (era_array_walk(md, era_array_root,
-	                   array_cb, &ast, NULL, NULL))
-		goto out;
+		if (!id || memcmp(id, era_snapshot_metadata_id(r),
+		                  UUID_LEN))
+		{
+			printv(1, "snapshot: previous snapshot is not of "
+			          "this metadata, full copy\n");
+			era_snapshot_close(r);
+			r = NULL;
+		}
+		else if (i == ws_total)
+		{
+			printv(1, "snapshot: writeset for era %u is gone, "
+			          "full copy\n", prev_era);
+			era_snapshot_close(r);
+			r = NULL;
+		}
+		else
+			printv(1, "snapshot: incremental copy "
+			          "from era %u\n", prev_era);
+	}
 
-	if (ast.total < entries)
+	eras = malloc(sizeof(uint32_t) * SNAP_WINDOW);
+	words = malloc(sizeof(uint64_t) * SNAP_WINDOW / 64);
+	if (!eras || !words)
 	{
-		// TODO: fill tail by zero eras
-		error(0, "trunacted era array");
+		error(ENOMEM, NULL);
 		goto out;
 	}
 
+	for (start = 0; start < entries; start += count)
+	{
+		count = entries - start < SNAP_WINDOW ?
+		        entries - start : SNAP_WINDOW;
+
+		if (r)
+		{
+			if (era_snapshot_read(r, start, count, eras))
+				goto out;
+		}
+		else if (era_array_lookup_range(md, era_array_root,
+		                                start, start + count, eras))
+			goto out;
+
+		for (i = 0; i < ws_total; i++)
+		{
+			if (start >= ws[i].nr_bits)
+				continue;
+
+			if (r && ws[i].era < prev_era)
+				continue;
+
+			bits = ws[i].nr_bits - start < count ?
+			       ws[i].nr_bits - start : count;
+			nr_words = (bits + 63) / 64;
+
+			if (era_bitset_lookup_range(md, ws[i].root,
+			                            start / 64,
+			                            start / 64 + nr_words,
+			                            words))
+				goto out;
+
+			// drop bits past the end of writeset
+			if (bits % 64)
+				words[nr_words - 1] &=
+					(1ULL << (bits % 64)) - 1;
+
+			era_merge(eras, words, nr_words, ws[i].era);
+		}
+
+		if (extent_add(&w, start, eras, count))
+			goto out;
+	}
+
+	if (extent_finish(&w) || md_write_flush(sn))
+		goto out;
+
+	*nr_extents = w.total;
+	*extent_blocks = (unsigned)(w.nr - 1);
+
+	printv(1, "snapshot: %u extents in %u blocks\n",
+	       *nr_extents, *extent_blocks);
+
 	rc = 0;
 out:
+	if (r)
+		era_snapshot_close(r);
+	free(ws);
+	free(words);
+	free(eras);
+	munmap(w.batch, MD_BLOCK_SIZE * SNAP_BATCH);
+
+	return rc;
+}
+
+/*
+ * snapshot reader
+ *
+ * raw runs come from dense nodes (version 1) or from extents
+ * split by bitmap of snapshot era (version 2), adjacent raw
+ * runs of the same era are merged before they are returned
+ */
+struct era_snapshot_reader {
+	struct md *sn;
+	unsigned version;
+	unsigned entries;
+	unsigned era;
+	__u8 metadata_id[UUID_LEN];   // zero for version 1
+
+	// era area blocks, read SNAP_BATCH at once
+	void *batch;
+	uint64_t nr;        // next block to read
+	uint64_t last;      // block past the area
+	unsigned loaded;    // blocks in batch
+	unsigned next;      // next block of batch
+	void *block;        // current block
+	unsigned index;     // next entry of current block
+	unsigned size;      // entries in current block
+
+	unsigned chunk;     // chunks passed by raw runs
+
+	// version 2: rest of current extent, snapshot era chunks
+	unsigned ext_length;
+	unsigned ext_era;
+	unsigned long *bitmap;
+
+	// merged run ahead
+	int ahead;
+	unsigned ahead_start;
+	unsigned ahead_length;
+	unsigned ahead_era;
+
+	// era_snapshot_read position and rest of its run
+	unsigned pos;
+	unsigned run_length;
+	unsigned run_era;
+};
 
-	/*
-	 * free writesets memory
-	 */
+static int reader_block(struct era_snapshot_reader *r)
+{
+	struct era_snapshot_extents *extents;
+	unsigned count;
 
-	if (wst.ws && wst.total > 0)
+	if (r->next == r->loaded)
 	{
-		unsigned i;
-		for (i = 0; i < wst.total; i++)
+		if (r->nr >= r->last)
 		{
-			if (wst.ws[i].bitmap)
-				free(wst.ws[i].bitmap);
+			error(0, "snapshot is truncated at chunk %u",
+			      r->chunk);
+			return -1;
 		}
-		free(wst.ws);
+
+		count = r->last - r->nr < SNAP_BATCH ?
+		        (unsigned)(r->last - r->nr) : SNAP_BATCH;
+
+		if (snapshot_read(r->sn, r->nr, r->batch, count,
+		                  r->version == 1 ? SNAP_ARRAY_CSUM_XOR :
+		                                    SNAP_EXTENT_CSUM_XOR))
+			return -1;
+
+		r->nr += count;
+		r->loaded = count;
+		r->next = 0;
 	}
 
-	return rc;
+	r->block = r->batch + MD_BLOCK_SIZE * r->next++;
+	r->index = 0;
+
+	if (r->version == 1)
+	{
+		r->size = ERAS_PER_BLOCK;
+		return 0;
+	}
+
+	extents = r->block;
+	r->size = le32toh(extents->nr_extents);
+
+	if (r->size > EXTENTS_PER_BLOCK)
+	{
+		error(0, "bad snapshot extent block: %llu",
+		      (long long unsigned)(r->nr - r->loaded + r->next - 1));
+		return -1;
+	}
+
+	return 0;
 }
 
-static int writesets_search_cb(void *arg, unsigned size,
-                               void *keys, void *values)
+// equal eras of a dense node
+static int raw_run_v1(struct era_snapshot_reader *r, unsigned *start,
+                      unsigned *length, unsigned *era)
 {
-	struct writesets_find *state = arg;
-	struct era_writeset *ews = values;
-	uint64_t *eras = keys;
-	unsigned i;
+	struct era_snapshot_node *node;
+	unsigned i, end;
+	__le32 value;
 
-	if (state->found_root > 0)
+	if (r->chunk == r->entries)
 		return 0;
 
-	for (i = 0; i < size; i++)
+	if (r->index == r->size && reader_block(r))
+		return -1;
+
+	node = r->block;
+
+	end = r->size - r->index;
+	if (end > r->entries - r->chunk)
+		end = r->entries - r->chunk;
+	end += r->index;
+
+	value = node->era[r->index];
+	for (i = r->index + 1; i < end && node->era[i] == value; i++);
+
+	*start = r->chunk;
+	*length = i - r->index;
+	*era = le32toh(value);
+
+	r->chunk += *length;
+	r->index = i;
+
+	return 1;
+}
+
+// part of an extent inside or outside of snapshot era bitmap
+static int raw_run_v2(struct era_snapshot_reader *r, unsigned *start,
+                      unsigned *length, unsigned *era)
+{
+	struct era_snapshot_extents *extents;
+	struct era_snapshot_extent *ext;
+	unsigned long end, next;
+	unsigned s, l;
+
+	if (r->chunk == r->entries)
+		return 0;
+
+	if (r->ext_length == 0)
+	{
+		while (r->index == r->size)
+			if (reader_block(r))
+				return -1;
+
+		extents = r->block;
+		ext = &extents->extent[r->index++];
+
+		s = le32toh(ext->start);
+		l = le32toh(ext->length);
+
+		if (s != r->chunk || l == 0 || l > r->entries - s)
+		{
+			error(0, "bad snapshot extent at chunk %u", r->chunk);
+			return -1;
+		}
+
+		r->ext_length = l;
+		r->ext_era = le32toh(ext->era);
+	}
+
+	end = r->chunk + r->ext_length;
+
+	if (test_bit(r->chunk, r->bitmap))
+	{
+		next = find_next_zero_bit(r->bitmap, end, r->chunk);
+		*era = r->era;
+	}
+	else
+	{
+		next = find_next_bit(r->bitmap, end, r->chunk);
+		*era = r->ext_era;
+	}
+
+	*start = r->chunk;
+	*length = (unsigned)(next - r->chunk);
+
+	r->ext_length -= *length;
+	r->chunk = (unsigned)next;
+
+	return 1;
+}
+
+static int raw_run(struct era_snapshot_reader *r, unsigned *start,
+                   unsigned *length, unsigned *era)
+{
+	if (r->version == 1)
+		return raw_run_v1(r, start, length, era);
+
+	return raw_run_v2(r, start, length, era);
+}
+
+// load bitmap of chunks written in snapshot era
+static int reader_bitmap(struct era_snapshot_reader *r, uint64_t nr)
+{
+	struct era_snapshot_bitmap *block;
+	unsigned long longs = LONGS(r->entries);
+	unsigned long words = (r->entries + 63) / 64;
+	unsigned long w;
+	unsigned blocks = SNAP_BITMAP_BLOCKS(r->entries);
+	unsigned i, j, k, count;
+
+	r->bitmap = malloc(sizeof(long) * (longs ? longs : 1));
+	if (!r->bitmap)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
+
+	for (i = 0; i < blocks; i += count)
+	{
+		count = blocks - i < SNAP_BATCH ? blocks - i : SNAP_BATCH;
+
+		if (snapshot_read(r->sn, nr + i, r->batch, count,
+		                  SNAP_BITMAP_CSUM_XOR))
+			return -1;
+
+		for (j = 0; j < count; j++)
+		{
+			block = r->batch + MD_BLOCK_SIZE * j;
+			w = (i + j) * BITMAP_WORDS_PER_BLOCK;
+
+			for (k = 0; k < BITMAP_WORDS_PER_BLOCK &&
+			            w + k < words; k++)
+				bitmap_set_word(r->bitmap, longs, w + k,
+				                le64toh(block->bits[k]));
+		}
+	}
+
+	return 0;
+}
+
+struct era_snapshot_reader *era_snapshot_open(struct md *sn)
+{
+	struct era_snapshot_superblock *ssb;
+	struct era_snapshot_reader *r;
+	unsigned extent_blocks = 0;
+	unsigned bitmap_blocks = 0;
+
+	ssb = md_block(sn, 0, 0, SNAP_SUPERBLOCK_CSUM_XOR);
+	if (!ssb || era_ssb_check(ssb))
+		return NULL;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+	{
+		error(ENOMEM, NULL);
+		return NULL;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->sn = sn;
+	r->version = le32toh(ssb->version);
+	r->entries = le32toh(ssb->nr_blocks);
+	r->era = le32toh(ssb->snapshot_era);
+	r->nr = 1;
+
+	if (r->version == 1)
+		r->last = 1 + (r->entries + ERAS_PER_BLOCK - 1) /
+		              ERAS_PER_BLOCK;
+	else
+	{
+		extent_blocks = le32toh(ssb->extent_blocks);
+		bitmap_blocks = le32toh(ssb->bitmap_blocks);
+		r->last = 1 + extent_blocks;
+		memcpy(r->metadata_id, ssb->metadata_id, UUID_LEN);
+
+		if (bitmap_blocks != SNAP_BITMAP_BLOCKS(r->entries))
+		{
+			error(0, "invalid snapshot superblock");
+			free(r);
+			return NULL;
+		}
+	}
+
+	r->batch = mmap(NULL, MD_BLOCK_SIZE * SNAP_BATCH,
+	                PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->batch == MAP_FAILED)
+	{
+		error(ENOMEM, NULL);
+		free(r);
+		return NULL;
+	}
+
+	if (r->version > 1 && reader_bitmap(r, 1 + extent_blocks))
+	{
+		era_snapshot_close(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/*
+ * next run of chunks with the same era: returns 1 and the run,
+ * 0 past the last chunk or -1 on error
+ */
+int era_snapshot_next_run(struct era_snapshot_reader *r, unsigned *start,
+                          unsigned *length, unsigned *era)
+{
+	unsigned s, l, e;
+	int rc;
+
+	if (!r->ahead)
+	{
+		rc = raw_run(r, &r->ahead_start, &r->ahead_length,
+		             &r->ahead_era);
+		if (rc != 1)
+			return rc;
+	}
+
+	for (;;)
+	{
+		rc = raw_run(r, &s, &l, &e);
+		if (rc == -1)
+			return -1;
+
+		if (rc == 1 && e == r->ahead_era)
+		{
+			r->ahead_length += l;
+			continue;
+		}
+
+		*start = r->ahead_start;
+		*length = r->ahead_length;
+		*era = r->ahead_era;
+
+		r->ahead = rc;
+		r->ahead_start = s;
+		r->ahead_length = l;
+		r->ahead_era = e;
+
+		return 1;
+	}
+}
+
+/*
+ * eras of count chunks from start, windows are read one by one
+ */
+int era_snapshot_read(struct era_snapshot_reader *r, unsigned start,
+                      unsigned count, uint32_t *eras)
+{
+	unsigned i, n, s;
+	int rc;
+
+	if (start != r->pos)
+	{
+		error(0, "snapshot read out of order: chunk %u", start);
+		return -1;
+	}
+
+	for (i = 0; i < count;)
 	{
-		if ((unsigned)le64toh(eras[i]) == state->find_era)
+		if (r->run_length == 0)
 		{
-			state->found_bits = le32toh(ews[i].nr_bits);
-			state->found_root = le64toh(ews[i].root);
-			return 0;
+			rc = era_snapshot_next_run(r, &s, &r->run_length,
+			                           &r->run_era);
+			if (rc == -1)
+				return -1;
+
+			if (rc == 0)
+			{
+				error(0, "snapshot is too short: %u chunks",
+				      r->pos + i);
+				return -1;
+			}
 		}
+
+		n = count - i < r->run_length ? count - i : r->run_length;
+		r->run_length -= n;
+
+		while (n--)
+			eras[i++] = r->run_era;
 	}
 
+	r->pos += count;
 	return 0;
 }
 
+unsigned era_snapshot_era(struct era_snapshot_reader *r)
+{
+	return r->era;
+}
+
+const void *era_snapshot_metadata_id(struct era_snapshot_reader *r)
+{
+	return r->metadata_id;
+}
+
+void era_snapshot_close(struct era_snapshot_reader *r)
+{
+	munmap(r->batch, MD_BLOCK_SIZE * SNAP_BATCH);
+	free(r->bitmap);
+	free(r);
+}
+
+/*
+ * get bitmap of chunks written in era
+ *
+ * when writeset of era is already digested into era_array,
+ * chunks of era and later ones are taken from era_array:
+ * later eras could overwrite era, so they are included too
+ */
 unsigned long *era_snapshot_getbitmap(struct md *md, unsigned era,
                                       uint64_t superblock, unsigned entries)
 {
 	struct era_superblock *sb;
-	struct writesets_find wst;
+	struct era_writeset *ews;
+	struct era_cursor *c;
 	struct bitset_state bst;
+	struct array_state ast;
 	uint64_t writeset_tree_root;
+	uint64_t era_array_root;
+	uint64_t found_root = 0;
+	uint32_t found_bits = 0;
 	unsigned long *bitmap;
+	void *keys, *values;
+	uint64_t index;
+	unsigned size;
+	int rc;
+
+	// metadata changed since cached blocks were read
+	md_flush(md);
 
 	sb = md_block(md, MD_CACHED, superblock, SUPERBLOCK_CSUM_XOR);
 	if (!sb || era_sb_check(sb))
 		return NULL;
 
 	writeset_tree_root = le64toh(sb->writeset_tree_root);
+	era_array_root = le64toh(sb->era_array_root);
 
-	wst = (struct writesets_find) {
-		.find_era = era,
-		.found_root = 0,
-		.found_bits = 0,
-	};
-
-	md_flush(md);
-
-	if (era_writesets_walk(md, writeset_tree_root,
-	                       writesets_search_cb, &wst, NULL, NULL))
+	c = era_cursor_open(md, writeset_tree_root, LEAF_WRITESET);
+	if (!c)
 		return NULL;
 
-	if (wst.found_root == 0 || wst.found_bits == 0)
+	rc = era_cursor_seek(c, era);
+	if (rc == 0)
+		rc = era_cursor_next(c, &index, &size, &keys, &values);
+
+	if (rc == 1 && index == era)
 	{
-		error(0, "can't find writeset for era %u", era);
-		return NULL;
+		ews = values;
+		found_bits = le32toh(ews->nr_bits);
+		found_root = le64toh(ews->root);
 	}
 
-	if (wst.found_bits != entries)
+	era_cursor_close(c);
+
+	if (rc == -1)
+		return NULL;
+
+	if (found_root && found_bits != entries)
 	{
 		error(0, "wrong bitset size: expected %u, but got %u",
-		      entries, wst.found_bits);
+		      entries, found_bits);
 		return NULL;
 	}
 
@@ -403,16 +1016,44 @@ unsigned long *era_snapshot_getbitmap(struct md *md, unsigned era,
 
 	memset(bitmap, 0, sizeof(long) * LONGS(entries));
 
+	if (found_root == 0)
+	{
+		printv(1, "era: writeset for era %u is digested, "
+		          "use era_array\n", era);
+
+		ast = (struct array_state) {
+			.era = era,
+			.total = 0,
+			.maximum = entries,
+			.bitmap = bitmap,
+		};
+
+		if (era_array_pwalk(md, era_array_root, jobs,
+		                    array_cb, &ast, NULL, NULL))
+		{
+			free(bitmap);
+			return NULL;
+		}
+
+		if (ast.total != entries)
+		{
+			error(0, "wrong era array size: expected %u, "
+			         "but found %u", entries, ast.total);
+			free(bitmap);
+			return NULL;
+		}
+
+		return bitmap;
+	}
+
 	bst = (struct bitset_state) {
 		.total = 0,
 		.maximum = entries,
 		.bitmap = bitmap,
 	};
 
-	md_flush(md);
-
-	if (era_bitset_walk(md, wst.found_root,
-	                    bitset_cb, &bst, NULL, NULL))
+	if (era_bitset_pwalk(md, found_root, jobs,
+	                     bitset_cb, &bst, NULL, NULL))
 	{
 		free(bitmap);
 		return NULL;
@@ -429,66 +1070,57 @@ unsigned long *era_snapshot_getbitmap(struct md *md, unsigned era,
 	return bitmap;
 }
 
-int era_snapshot_digest(struct md *sn, unsigned era,
+/*
+ * write bitmap of chunks written in snapshot era as bitmap blocks
+ * from block nr on, the bitmap overrides eras of extents
+ */
+int era_snapshot_digest(struct md *sn, uint64_t nr,
                         unsigned long *bitmap, unsigned entries)
 {
-	uint64_t i, j, snap_blocks;
+	struct era_snapshot_bitmap *block;
+	unsigned long longs = LONGS(entries);
+	unsigned long words = (entries + 63) / 64;
+	unsigned long w;
+	unsigned blocks = SNAP_BITMAP_BLOCKS(entries);
+	unsigned i, j, k, count;
+	void *batch;
+	int rc = -1;
 
-	snap_blocks = (entries + ERAS_PER_BLOCK - 1) / ERAS_PER_BLOCK;
+	batch = mmap(NULL, MD_BLOCK_SIZE * SNAP_BATCH, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (batch == MAP_FAILED)
+	{
+		error(ENOMEM, NULL);
+		return -1;
+	}
 
-	for (i = 0; i < snap_blocks; i++)
+	for (i = 0; i < blocks; i += count)
 	{
-		struct era_snapshot_node *node = NULL;
-		uint64_t from, to;
-		uint32_t csum;
+		count = blocks - i < SNAP_BATCH ? blocks - i : SNAP_BATCH;
 
-		from = i * ERAS_PER_BLOCK;
-		to = from + ERAS_PER_BLOCK > entries ?
-		     entries : from + ERAS_PER_BLOCK;
+		memset(batch, 0, MD_BLOCK_SIZE * count);
 
-		for (j = from; j < to; j++)
+		for (j = 0; j < count; j++)
 		{
-			unsigned long offset = j / BITS_PER_LONG;
-			unsigned long bit = j & (BITS_PER_LONG - 1);
-
-			if (bit == 0 && bitmap[offset] == 0)
-			{
-				j += BITS_PER_LONG - 1;
-				continue;
-			}
-
-			if (!((bitmap[offset] >> bit) & 1))
-				continue;
-
-			if (!node)
-			{
-				node = md_block(sn, 0, i + 1,
-				                SNAP_ARRAY_CSUM_XOR);
-				if (!node)
-					return -1;
-
-				if (le64toh(node->blocknr) != i + 1)
-				{
-					error(0, "bad snapshot block: %llu",
-					      (long long unsigned)(i + 1));
-					return -1;
-				}
-			}
+			block = batch + MD_BLOCK_SIZE * j;
+			w = (i + j) * BITMAP_WORDS_PER_BLOCK;
 
-			node->era[j - from] = htole32(era);
+			for (k = 0; k < BITMAP_WORDS_PER_BLOCK &&
+			            w + k < words; k++)
+				block->bits[k] = htole64(bitmap_word(bitmap,
+				                         longs, w + k));
 		}
 
-		if (node)
-		{
-			csum = crc_update(crc_init(), &node->flags,
-			                  MD_BLOCK_SIZE - sizeof(node->csum));
-			node->csum = htole32(csum ^ SNAP_ARRAY_CSUM_XOR);
-
-			if (md_write(sn, i + 1, node))
-				return -1;
-		}
+		if (snapshot_write(sn, nr + i, batch, count,
+		                   SNAP_BITMAP_CSUM_XOR))
+			goto out;
 	}
 
-	return 0;
-}
+	if (md_write_flush(sn))
+		goto out;
 
+	rc = 0;
+out:
+	munmap(batch, MD_BLOCK_SIZE * SNAP_BATCH);
+	return rc;
+}
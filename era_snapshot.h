@@ -7,7 +7,8 @@
 
 #define SNAP_SUPERBLOCK_CSUM_XOR 13116488
 #define SNAP_SUPERBLOCK_MAGIC 118135908
-#define SNAP_VERSION 1
+#define SNAP_MIN_VERSION 1
+#define SNAP_VERSION 2
 
 struct era_snapshot_superblock {
 	__le32 csum;
@@ -24,8 +25,20 @@ struct era_snapshot_superblock {
 	__le32 nr_blocks;
 
 	__le32 snapshot_era;
+
+	/* version 2 */
+	__le32 nr_extents;
+	__le32 extent_blocks;
+	__le32 bitmap_blocks;
+
+	/* era metadata id (era_spacemap.h), zero if it has none */
+	__u8 metadata_id[UUID_LEN];
 } __attribute__ ((packed));
 
+/*
+ * version 1: dense era array in nodes from block 1
+ */
+
 #define SNAP_ARRAY_CSUM_XOR 18275559
 
 struct era_snapshot_node {
@@ -39,14 +52,86 @@ struct era_snapshot_node {
 #define ERAS_PER_BLOCK \
 	((MD_BLOCK_SIZE - sizeof(struct era_snapshot_node)) / sizeof(uint32_t))
 
+/*
+ * version 2: era runs as sorted extents from block 1, followed
+ * by bitmap of chunks written in snapshot era; bitmap overrides
+ * extents, so extents are complete before suspend and bitmap
+ * has fixed size known in advance
+ */
+
+#define SNAP_EXTENT_CSUM_XOR 27418939
+#define SNAP_BITMAP_CSUM_XOR 30514723
+
+struct era_snapshot_extent {
+	__le32 start;
+	__le32 length;
+	__le32 era;
+} __attribute__ ((packed));
+
+struct era_snapshot_extents {
+	__le32 csum;
+	__le32 flags;
+	__le64 blocknr;
+
+	__le32 nr_extents;
+	__le32 padding;
+
+	struct era_snapshot_extent extent[0];
+} __attribute__ ((packed));
+
+#define EXTENTS_PER_BLOCK \
+	((MD_BLOCK_SIZE - sizeof(struct era_snapshot_extents)) / \
+	 sizeof(struct era_snapshot_extent))
+
+struct era_snapshot_bitmap {
+	__le32 csum;
+	__le32 flags;
+	__le64 blocknr;
+
+	__le64 bits[0];
+} __attribute__ ((packed));
+
+#define BITMAP_WORDS_PER_BLOCK \
+	((MD_BLOCK_SIZE - sizeof(struct era_snapshot_bitmap)) / \
+	 sizeof(uint64_t))
+
+#define BITMAP_BITS_PER_BLOCK (BITMAP_WORDS_PER_BLOCK * 64)
+
+#define SNAP_BITMAP_BLOCKS(entries) \
+	(((entries) + BITMAP_BITS_PER_BLOCK - 1) / BITMAP_BITS_PER_BLOCK)
+
+// snapshot blocks sealed and written per batch
+#define SNAP_BATCH 64
+
+// chunks copied at once: whole snapshot nodes and bitset words
+#define SNAP_WINDOW (ERAS_PER_BLOCK * 1024)
+
 int era_ssb_check(struct era_snapshot_superblock *ssb);
 
-int era_snapshot_copy(struct md *md, struct md *sn,
-                      uint64_t superblock, unsigned entries);
+int era_snapshot_copy(struct md *md, struct md *sn, struct md *prev,
+                      uint64_t superblock, unsigned entries,
+                      unsigned *nr_extents, unsigned *extent_blocks,
+                      void *metadata_id);
 
-int era_snapshot_digest(struct md *sn, unsigned era,
+int era_snapshot_digest(struct md *sn, uint64_t nr,
                         unsigned long *bitmap, unsigned entries);
 
+/*
+ * snapshot reader for all versions: era runs in chunk order,
+ * or eras of consecutive windows of chunks
+ */
+
+struct era_snapshot_reader;
+
+struct era_snapshot_reader *era_snapshot_open(struct md *sn);
+int era_snapshot_next_run(struct era_snapshot_reader *r, unsigned *start,
+                          unsigned *length, unsigned *era);
+int era_snapshot_read(struct era_snapshot_reader *r, unsigned start,
+                      unsigned count, uint32_t *eras);
+unsigned era_snapshot_era(struct era_snapshot_reader *r);
+const void *era_snapshot_metadata_id(struct era_snapshot_reader *r);
+void era_snapshot_close(struct era_snapshot_reader *r);
+
 unsigned long *era_snapshot_getbitmap(struct md *md, unsigned era,
                                       uint64_t superblock, unsigned entries);
 
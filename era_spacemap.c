@@ -4,202 +4,278 @@
 
 #define _GNU_SOURCE
 
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <endian.h>
 #include <errno.h>
 
-#include "crc32c.h"
 #include "bitmap.h"
+#include "crc32c.h"
 #include "era.h"
 #include "era_md.h"
 #include "era_btree.h"
 #include "era_spacemap.h"
+#include "era_sm_encode.h"
+
+/*
+ * block allocator over rebuild bitmap: there are no free
+ * blocks before cursor, so searches never rescan the head
+ * of the bitmap and all allocations take linear time total
+ */
+
+struct sm_alloc {
+	unsigned long *bitmap;
+	unsigned long size;
+	unsigned long cursor;
+};
 
-static unsigned long first_unset_bit(unsigned long size, unsigned long *bitmap)
+// allocate count contiguous blocks, -1 if there is no such run
+static int sm_alloc_run(struct sm_alloc *a, unsigned long count,
+                        uint64_t *blocknr)
 {
-	unsigned long longs = LONGS(size);
-	unsigned long offset;
-	for (offset = 0; offset < longs; offset++)
+	unsigned long start, end, i;
+
+	a->cursor = find_next_zero_bit(a->bitmap, a->size, a->cursor);
+
+	for (start = a->cursor; start < a->size && count <= a->size - start;)
 	{
-		int nr = ffsl(~bitmap[offset]);
-		if (nr > 0)
+		end = find_next_bit(a->bitmap, start + count, start);
+		if (end == start + count)
 		{
-			unsigned long rc = BITS_PER_LONG * offset + nr;
-			if (rc > size)
-				return 0;
-			else
-				return rc;
+			for (i = start; i < end; i++)
+				set_bit(i, a->bitmap);
+
+			if (start == a->cursor)
+				a->cursor = end;
+
+			*blocknr = start;
+			return 0;
 		}
+
+		start = find_next_zero_bit(a->bitmap, a->size, end);
 	}
-	return 0;
+
+	return -1;
 }
 
 /*
- * rebuild spacemap
+ * allocate count blocks: in one run if there is room,
+ * otherwise the first free blocks one by one
  */
-
-static int bitmap_cb(void *arg, uint64_t blocknr, void *block)
+static int sm_alloc_blocks(struct sm_alloc *a, unsigned count,
+                           uint64_t *blocks)
 {
-	unsigned long *bitmap = arg;
-	if (test_and_set_bit((unsigned long)blocknr, bitmap))
+	uint64_t blocknr;
+	unsigned i;
+
+	if (sm_alloc_run(a, count, &blocknr) == 0)
 	{
-		error(0, "block %llu already in use",
-		         (long long unsigned)blocknr);
-		return -1;
+		for (i = 0; i < count; i++)
+			blocks[i] = blocknr + i;
+		return 0;
 	}
-	return 0;
-}
 
-static int bitset_cb(void *arg, unsigned size, void *dummy, void *data)
-{
-	unsigned *total = arg;
-	*total += size;
-	return 0;
-}
+	for (i = 0; i < count; i++)
+		if (sm_alloc_run(a, 1, &blocks[i]))
+			return -1;
 
-static int array_cb(void *arg, unsigned size, void *dummy, void *data)
-{
-	unsigned *total = arg;
-	*total += size;
 	return 0;
 }
 
-struct writesets_state {
-	unsigned nr_blocks;
+/*
+ * rebuild spacemap
+ */
+
+/*
+ * rebuild walk state: array blocks are counted by tree type,
+ * their entries only when they are read (--verify-leaves)
+ */
+struct rebuild_state {
 	unsigned long *bitmap;
-	struct md *md;
+	uint64_t sm_blocks;          /* blocks covered by spacemap */
+	unsigned nr_blocks;
+	unsigned writesets;          /* archived writesets */
+	unsigned array_blocks;       /* era_array blocks */
+	unsigned array_entries;
+	unsigned bitset_blocks;      /* blocks of all bitsets */
+	unsigned bitset_entries;
 };
 
-static int writesets_cb(void *arg, unsigned size, void *keys, void *values)
+static int bitmap_cb(void *arg, uint64_t blocknr, void *block)
 {
-	struct writesets_state *state = arg;
-	struct era_writeset *ws;
-	uint64_t *eras;
-	unsigned i;
-
-	if (size == 0)
-		return 0;
+	struct rebuild_state *state = arg;
 
-	ws = malloc(sizeof(*ws) * size);
-	if (!ws)
+	if (blocknr >= state->sm_blocks)
 	{
-		error(ENOMEM, NULL);
+		error(0, "block %llu is beyond metadata space map limit",
+		         (long long unsigned)blocknr);
 		return -1;
 	}
 
-	eras = malloc(sizeof(*eras) * size);
-	if (!eras)
+	if (test_and_set_bit_atomic((unsigned long)blocknr, state->bitmap))
 	{
-		error(ENOMEM, NULL);
-		free(ws);
+		error(0, "block %llu already in use",
+		         (long long unsigned)blocknr);
 		return -1;
 	}
+	return 0;
+}
 
-	memcpy(ws, values, sizeof(*ws) * size);
-	memcpy(eras, keys, sizeof(*eras) * size);
+static int writesets_cb(void *arg, uint64_t index, unsigned size,
+                        void *keys, void *values)
+{
+	struct rebuild_state *state = arg;
+	struct era_writeset *ws = values;
+	__le64 *eras = keys;
+	unsigned i, bits;
 
 	for (i = 0; i < size; i++)
 	{
-		unsigned era = (unsigned)le64toh(eras[i]);
-		unsigned bits = le32toh(ws[i].nr_bits);
-		uint64_t root = le64toh(ws[i].root);
-		unsigned total = 0;
+		bits = le32toh(ws[i].nr_bits);
 
 		if (bits != state->nr_blocks)
 		{
 			error(0, "writeset.nr_bits for era %u mismatch: "
 			         "expected %u, but got %u",
-			         era, state->nr_blocks, bits);
-			goto out;
+			         (unsigned)le64toh(eras[i]),
+			         state->nr_blocks, bits);
+			return -1;
 		}
+	}
 
-		md_flush(state->md);
+	__atomic_add_fetch(&state->writesets, size, __ATOMIC_RELAXED);
+	return 0;
+}
 
-		if (era_bitset_walk(state->md, root,
-		                    bitset_cb, &total,
-		                    bitmap_cb, state->bitmap) == -1)
-			goto out;
+static int array_cb(void *arg, enum leaf_type type, uint64_t key,
+                    struct array_node *node)
+{
+	struct rebuild_state *state = arg;
+	unsigned entries = node ? le32toh(node->header.nr_entries) : 0;
 
-		if (total != (state->nr_blocks + 63) / 64)
-		{
-			error(0, "writeset for era %u elements mismatch: "
-			         "expected %u, but got %u",
-			         era, (state->nr_blocks + 63) / 64, total);
-			goto out;
-		}
+	if (type == LEAF_ARRAY)
+	{
+		__atomic_add_fetch(&state->array_blocks, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&state->array_entries, entries,
+		                   __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_add_fetch(&state->bitset_blocks, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&state->bitset_entries, entries,
+		                   __ATOMIC_RELAXED);
 	}
 
-	free(eras);
-	free(ws);
 	return 0;
+}
 
-out:
-	free(eras);
-	free(ws);
-	return -1;
+/*
+ * get count 64-bit words of bitmap from bit nr (a multiple of
+ * 64) for the encoder: bitmap is in longs of host size, it must
+ * be allocated in whole 64-bit words
+ */
+static void bitmap_words64(uint64_t *words, const unsigned long *bitmap,
+                           uint64_t nr, unsigned count)
+{
+	unsigned i, k;
+
+	bitmap += nr / BITS_PER_LONG;
+
+	for (i = 0; i < count; i++)
+	{
+		words[i] = 0;
+
+		for (k = 0; k < 64; k += BITS_PER_LONG)
+			words[i] |= (uint64_t)*bitmap++ << k;
+	}
 }
 
 /*
- * create and save new spacemap using bitmap;
+ * create and save new spacemap of first nr_blocks using bitmap;
  * only one ref count per block supported
  */
 
 static int era_spacemap_write(struct md *md, unsigned long *bitmap,
+                              uint64_t nr_blocks,
                               struct disk_sm_root *smr)
 {
 	struct disk_metadata_index *index;
 	struct btree_node *ref_count;
+	struct sm_alloc alloc;
+	struct md_csum *csums;
 	uint64_t index_root;
 	uint64_t ref_count_root;
 	uint64_t nr_allocated;
-	uint32_t csum;
 	unsigned max_entries;
 	uint64_t bm_blocks;
+	uint64_t *blocks;
+	void *bitmaps;
 	unsigned i;
 
 	/*
-	 * allocate memory for the index and ref count blocks
+	 * check metadata size
+	 */
+
+	bm_blocks = (nr_blocks + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+	if (bm_blocks > MAX_METADATA_BITMAPS)
+	{
+		error(0, "metadata is too large");
+		return -1;
+	}
+
+	/*
+	 * allocate memory for the index, ref count and bitmap blocks
 	 */
 
-	ref_count = malloc(MD_BLOCK_SIZE);
-	if (!ref_count)
+	csums = malloc(sizeof(*csums) * (bm_blocks + 2));
+	blocks = malloc(sizeof(*blocks) * (bm_blocks + 2));
+	if (!csums || !blocks)
 	{
 		error(ENOMEM, NULL);
+		free(blocks);
+		free(csums);
 		return -1;
 	}
 
-	index = malloc(MD_BLOCK_SIZE);
-	if (!index)
+	bitmaps = mmap(NULL, MD_BLOCK_SIZE * (bm_blocks + 2),
+	               PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bitmaps == MAP_FAILED)
 	{
 		error(ENOMEM, NULL);
-		free(ref_count);
+		free(blocks);
+		free(csums);
 		return -1;
 	}
 
-	memset(ref_count, 0, MD_BLOCK_SIZE);
-	memset(index, 0, MD_BLOCK_SIZE);
+	index = bitmaps + MD_BLOCK_SIZE * bm_blocks;
+	ref_count = bitmaps + MD_BLOCK_SIZE * (bm_blocks + 1);
 
 	/*
-	 * create index block
+	 * allocate index, ref count and bitmap blocks together
 	 */
 
-	bm_blocks = (md->blocks + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
-	if (bm_blocks > MAX_METADATA_BITMAPS)
-	{
-		error(0, "metadata is too large");
-		goto out;
-	}
+	alloc = (struct sm_alloc) {
+		.bitmap = bitmap,
+		.size = nr_blocks,
+		.cursor = 0,
+	};
 
-	index_root = first_unset_bit(md->blocks, bitmap);
-	if (index_root == 0)
+	if (sm_alloc_blocks(&alloc, bm_blocks + 2, blocks))
 	{
 		error(0, "there is no free space in metadata "
-		         "for the spacemap index block");
+		         "for the spacemap blocks");
 		goto out;
 	}
-	set_bit(--index_root, bitmap);
+
+	index_root = blocks[0];
+	ref_count_root = blocks[1];
+
+	/*
+	 * create index block
+	 */
 
 	index->blocknr = htole64(index_root);
 
@@ -217,116 +293,77 @@ static int era_spacemap_write(struct md *md, unsigned long *bitmap,
 	ref_count->header.max_entries = htole32(max_entries);
 	ref_count->header.value_size = htole32(sizeof(uint32_t));
 
-	ref_count_root = first_unset_bit(md->blocks, bitmap);
-	if (ref_count_root == 0)
-	{
-		error(0, "there is no free space in metadata "
-		         "for the spacemap ref count root block");
-		goto out;
-	}
-	set_bit(--ref_count_root, bitmap);
-
 	ref_count->header.blocknr = htole64(ref_count_root);
 
-	/*
-	 * allocate bitmap blocks
-	 */
-
 	for (i = 0; i < bm_blocks; i++)
-	{
-		uint64_t root = first_unset_bit(md->blocks, bitmap);
-		if (root == 0)
-		{
-			error(0, "there is no free space in metadata "
-			         "for the spacemap bitmap block");
-			goto out;
-		}
-		set_bit(--root, bitmap);
-
-		index->index[i].blocknr = htole64(root);
-	}
+		index->index[i].blocknr = htole64(blocks[i + 2]);
 
 	/*
-	 * write bitmap blocks
+	 * fill bitmap blocks
 	 */
 
 	nr_allocated = 0;
 
 	for (i = 0; i < bm_blocks; i++)
 	{
-		struct disk_bitmap_header *hdr = md->buffer;
-		unsigned char *bytes = md->buffer + sizeof(*hdr);
+		struct disk_bitmap_header *hdr = bitmaps + MD_BLOCK_SIZE * i;
+		unsigned char *bytes = (unsigned char *)hdr + sizeof(*hdr);
 		uint64_t root = le64toh(index->index[i].blocknr);
-		uint32_t nr_free;
+		uint64_t words[ENTRIES_PER_BLOCK / 64];
+		uint32_t nr_free, used;
 		unsigned from, to;
-		unsigned j, k;
-
-		memset(md->buffer, 0, MD_BLOCK_SIZE);
 
 		from = i * ENTRIES_PER_BLOCK;
-		to = from + ENTRIES_PER_BLOCK > md->blocks ?
-		     md->blocks : from + ENTRIES_PER_BLOCK;
+		to = from + ENTRIES_PER_BLOCK > nr_blocks ?
+		     nr_blocks : from + ENTRIES_PER_BLOCK;
 
-		nr_free = to - from;
+		// blocks start on word boundary: ENTRIES_PER_BLOCK % 64 == 0
+		bitmap_words64(words, bitmap, from, (to - from + 63) / 64);
+		used = era_sm_encode(bytes, words, to - from);
 
-		for (j = from, k = 0; j < to; j++, k++)
-		{
-			if (test_bit(j, bitmap))
-			{
-				/*
-				 * two bits per entry,
-				 * high and low bits are swapped
-				 */
-				unsigned offset = k / ENTRIES_PER_BYTE;
-				unsigned bit = ((k & 3) << 1) + 1;
-				bytes[offset] |= 1 << bit;
-				nr_allocated++;
-				nr_free--;
-			}
-		}
+		nr_allocated += used;
+		nr_free = to - from - used;
 
 		hdr->blocknr = htole64(root);
 
-		csum = crc_update(crc_init(), &hdr->not_used,
-		                  MD_BLOCK_SIZE - sizeof(hdr->csum));
-		hdr->csum = htole32(csum ^ BITMAP_CSUM_XOR);
-
-		if (md_write(md, root, hdr) == -1)
-			goto out;
+		csums[i].block = hdr;
+		csums[i].xor = BITMAP_CSUM_XOR;
 
 		index->index[i].none_free_before = 0;
 		index->index[i].nr_free = htole32(nr_free);
 	}
 
 	/*
-	 * write ref count block
+	 * seal all spacemap blocks at once
 	 */
 
-	csum = crc_update(crc_init(), &ref_count->header.flags,
-	                  MD_BLOCK_SIZE - sizeof(ref_count->header.csum));
-	ref_count->header.csum = htole32(csum ^ BTREE_CSUM_XOR);
+	csums[bm_blocks].block = index;
+	csums[bm_blocks].xor = INDEX_CSUM_XOR;
+	csums[bm_blocks + 1].block = ref_count;
+	csums[bm_blocks + 1].xor = BTREE_CSUM_XOR;
 
-	memcpy(md->buffer, ref_count, MD_BLOCK_SIZE);
-	if (md_write(md, ref_count_root, md->buffer))
-		goto out;
+	md_csum_seal_many(csums, bm_blocks + 2);
 
 	/*
-	 * write index block
+	 * write bitmap blocks, ref count block and index block
 	 */
 
-	csum = crc_update(crc_init(), &index->padding,
-	                  MD_BLOCK_SIZE - sizeof(index->csum));
-	index->csum = htole32(csum ^ INDEX_CSUM_XOR);
+	for (i = 0; i < bm_blocks; i++)
+		if (md_write(md, le64toh(index->index[i].blocknr),
+		             bitmaps + MD_BLOCK_SIZE * i) == -1)
+			goto out;
 
-	memcpy(md->buffer, index, MD_BLOCK_SIZE);
-	if (md_write(md, index_root, md->buffer))
+	if (md_write(md, ref_count_root, ref_count))
+		goto out;
+
+	if (md_write(md, index_root, index))
 		goto out;
 
 	/*
 	 * save disk_sm_root
 	 */
 
-	smr->nr_blocks = htole64(md->blocks);
+	smr->nr_blocks = htole64(nr_blocks);
 	smr->nr_allocated = htole64(nr_allocated);
 	smr->bitmap_root = htole64(index_root);
 	smr->ref_count_root = htole64(ref_count_root);
@@ -335,12 +372,14 @@ static int era_spacemap_write(struct md *md, unsigned long *bitmap,
 	 * done
 	 */
 
-	free(ref_count);
-	free(index);
+	munmap(bitmaps, MD_BLOCK_SIZE * (bm_blocks + 2));
+	free(blocks);
+	free(csums);
 	return 0;
 out:
-	free(ref_count);
-	free(index);
+	munmap(bitmaps, MD_BLOCK_SIZE * (bm_blocks + 2));
+	free(blocks);
+	free(csums);
 	return -1;
 }
 
@@ -356,39 +395,44 @@ int era_spacemap_rebuild(struct md *md)
 	unsigned long *bitmap;
 	struct disk_sm_root smr;
 	struct era_superblock *sb;
-	struct writesets_state wst;
+	struct rebuild_state state;
+	uint64_t sm_blocks, words64;
+	struct era_walk_root roots[3];
 	unsigned current_writeset_bits;
 	uint64_t current_writeset_root;
-	uint64_t writeset_tree_root;
-	uint64_t era_array_root;
-	unsigned nr_blocks;
-	unsigned total;
-	uint32_t csum;
+	unsigned nr_blocks, nr_roots = 0;
+	unsigned bitsets, words, expected;
+	struct md_csum csum;
 
 	/*
-	 * check metadata size
+	 * spacemap covers metadata up to kernel limit, the rest
+	 * of device stays readable, but is never allocated
 	 */
 
-	if (md->blocks > MAX_METADATA_BITMAPS * ENTRIES_PER_BLOCK)
+	sm_blocks = md->blocks;
+	if (sm_blocks > MAX_METADATA_BLOCKS)
 	{
-		md->blocks = MAX_METADATA_BITMAPS * ENTRIES_PER_BLOCK;
-		error(0, "Warning: metadata device is too big, "
-		         "only first %u MiB will be used",
-		         (unsigned)(md->blocks * MD_BLOCK_SIZE / 1048576));
+		sm_blocks = MAX_METADATA_BLOCKS;
+		printv(1, "era: space map covers first %llu of "
+		          "%llu metadata blocks\n",
+		          (long long unsigned)sm_blocks,
+		          (long long unsigned)md->blocks);
 	}
 
 	/*
 	 * prepare spacemap bitmap
 	 */
 
-	bitmap = malloc(sizeof(long) * LONGS(md->blocks));
+	// whole 64-bit words, they are encoded a word at a time
+	words64 = (sm_blocks + 63) / 64;
+	bitmap = malloc(sizeof(uint64_t) * words64);
 	if (!bitmap)
 	{
 		error(ENOMEM, NULL);
 		return -1;
 	}
 
-	memset(bitmap, 0, sizeof(long) * LONGS(md->blocks));
+	memset(bitmap, 0, sizeof(uint64_t) * words64);
 
 	/*
 	 * read btree roots from superblock
@@ -399,15 +443,9 @@ int era_spacemap_rebuild(struct md *md)
 		goto out;
 
 	nr_blocks = le32toh(sb->nr_blocks);
-	era_array_root = le32toh(sb->era_array_root);
-	writeset_tree_root = le32toh(sb->writeset_tree_root);
 	current_writeset_root = le64toh(sb->current_writeset.root);
 	current_writeset_bits = le32toh(sb->current_writeset.nr_bits);
 
-	/*
-	 * check and mark used blocks by current_writeset
-	 */
-
 	if (current_writeset_root != 0)
 	{
 		if (current_writeset_bits != nr_blocks)
@@ -418,60 +456,72 @@ int era_spacemap_rebuild(struct md *md)
 			goto out;
 		}
 
-		md_flush(md);
-
-		total = 0;
+		roots[nr_roots++] = (struct era_walk_root) {
+			current_writeset_root, LEAF_BITSET
+		};
+	}
 
-		if (era_bitset_walk(md, current_writeset_root,
-		                    bitset_cb, &total,
-		                    bitmap_cb, bitmap) == -1)
-			goto out;
+	roots[nr_roots++] = (struct era_walk_root) {
+		le64toh(sb->writeset_tree_root), LEAF_WRITESET
+	};
 
-		if (total != (nr_blocks + 63) / 64)
-		{
-			error(0, "current_writeset elements mismatch: "
-			         "expected %u, but got %u",
-			         (nr_blocks + 63) / 64, total);
-			goto out;
-		}
-	}
+	roots[nr_roots++] = (struct era_walk_root) {
+		le64toh(sb->era_array_root), LEAF_ARRAY
+	};
 
 	/*
-	 * check and mark used blocks by
-	 * writesets and all bitsets in it
+	 * check and mark blocks used by all trees at once:
+	 * btree leaves reference array blocks, so they are
+	 * marked without reading unless asked to verify them
 	 */
 
-	md_flush(md);
+	memset(&state, 0, sizeof(state));
+	state.bitmap = bitmap;
+	state.sm_blocks = sm_blocks;
+	state.nr_blocks = nr_blocks;
 
-	wst = (struct writesets_state) {
-		.nr_blocks = nr_blocks,
-		.bitmap = bitmap,
-		.md = md,
-	};
-
-	if (era_writesets_walk(md, writeset_tree_root,
-	                       writesets_cb, &wst,
-	                       bitmap_cb, bitmap) == -1)
+	if (era_metadata_pwalk(md, roots, nr_roots, jobs, verify_leaves,
+	                       writesets_cb, &state, array_cb, &state,
+	                       bitmap_cb, &state) == -1)
 		goto out;
 
-	/*
-	 * check and mark used blocks by era_array
-	 */
+	expected = (nr_blocks + ARRAY_ENTRIES(sizeof(uint32_t)) - 1) /
+	           ARRAY_ENTRIES(sizeof(uint32_t));
 
-	md_flush(md);
+	if (state.array_blocks != expected)
+	{
+		error(0, "era_array blocks mismatch: "
+		         "expected %u, but got %u",
+		         expected, state.array_blocks);
+		goto out;
+	}
 
-	total = 0;
+	bitsets = state.writesets + (current_writeset_root != 0);
+	words = (nr_blocks + 63) / 64;
+	expected = bitsets * ((words + ARRAY_ENTRIES(sizeof(uint64_t)) - 1) /
+	                      ARRAY_ENTRIES(sizeof(uint64_t)));
 
-	if (era_array_walk(md, era_array_root,
-	                   array_cb, &total,
-	                   bitmap_cb, bitmap) == -1)
+	if (state.bitset_blocks != expected)
+	{
+		error(0, "writeset blocks mismatch: "
+		         "expected %u, but got %u",
+		         expected, state.bitset_blocks);
 		goto out;
+	}
 
-	if (total != nr_blocks)
+	if (verify_leaves && state.array_entries != nr_blocks)
 	{
 		error(0, "era_array elements mismatch: "
 		         "expected %u, but got %u",
-		         nr_blocks, total);
+		         nr_blocks, state.array_entries);
+		goto out;
+	}
+
+	if (verify_leaves && state.bitset_entries != bitsets * words)
+	{
+		error(0, "writeset elements mismatch: "
+		         "expected %u, but got %u",
+		         bitsets * words, state.bitset_entries);
 		goto out;
 	}
 
@@ -479,14 +529,14 @@ int era_spacemap_rebuild(struct md *md)
 	 * mark superblock as used
 	 */
 
-	if (bitmap_cb(bitmap, 0, NULL))
+	if (bitmap_cb(&state, 0, NULL))
 		goto out;
 
 	/*
 	 * write spacemap
 	 */
 
-	if (era_spacemap_write(md, bitmap, &smr))
+	if (era_spacemap_write(md, bitmap, sm_blocks, &smr))
 		goto out;
 
 	/*
@@ -500,14 +550,17 @@ int era_spacemap_rebuild(struct md *md)
 	// drop metadata snapshot (not supported for now)
 	sb->metadata_snap = 0;
 
+	// spacemap is fresh, but not clean until close
+	memset((void *)sb + CLEAN_MARKER_OFFSET, 0,
+	       sizeof(struct era_clean_marker));
+
 	// save spacemap root
 	memset(sb->metadata_space_map_root, 0, SPACE_MAP_ROOT_SIZE);
 	memcpy(sb->metadata_space_map_root, &smr, sizeof(smr));
 
 	// calculate new checksum
-	csum = crc_update(crc_init(), &sb->flags,
-	                  MD_BLOCK_SIZE - sizeof(sb->csum));
-	sb->csum = htole32(csum ^ SUPERBLOCK_CSUM_XOR);
+	csum = (struct md_csum) { sb, SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
 
 	// write modified superblock
 	if (md_write(md, 0, sb))
@@ -524,3 +577,135 @@ out:
 	free(bitmap);
 	return -1;
 }
+
+/*
+ * clean shutdown marker
+ */
+
+static uint32_t clean_digest(struct era_superblock *sb)
+{
+	return crc_update(crc_init(), &sb->flags,
+	                  sizeof(*sb) - sizeof(uint32_t));
+}
+
+/*
+ * record clean shutdown: era target is gone, so superblock
+ * and spacemap stay as the kernel left them until open
+ */
+int era_spacemap_mark_clean(struct md *md)
+{
+	struct era_clean_marker *marker;
+	struct era_superblock *sb;
+	struct md_csum csum;
+
+	sb = md_block(md, 0, 0, SUPERBLOCK_CSUM_XOR);
+	if (!sb || era_sb_check(sb))
+		return -1;
+
+	// metadata snapshot is dropped by rebuild only
+	if (sb->metadata_snap)
+	{
+		printv(1, "era: metadata snapshot found, "
+		          "spacemap will be rebuilt on open\n");
+		return 0;
+	}
+
+	marker = (void *)sb + CLEAN_MARKER_OFFSET;
+	marker->magic = htole64(CLEAN_MARKER_MAGIC);
+	marker->md_blocks = htole64(md->blocks);
+	marker->digest = htole32(clean_digest(sb));
+
+	csum = (struct md_csum) { sb, SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
+
+	if (md_write(md, 0, sb))
+		return -1;
+
+	return md_sync(md);
+}
+
+/*
+ * check and consume clean shutdown marker: returns 1 if
+ * metadata is unchanged since close, 0 if spacemap has to
+ * be rebuilt, -1 on error
+ */
+int era_spacemap_clean(struct md *md)
+{
+	struct era_clean_marker *marker;
+	struct era_superblock *sb;
+	struct md_csum csum;
+
+	sb = md_block(md, 0, 0, SUPERBLOCK_CSUM_XOR);
+	if (!sb || era_sb_check(sb))
+		return -1;
+
+	marker = (void *)sb + CLEAN_MARKER_OFFSET;
+
+	if (le64toh(marker->magic) != CLEAN_MARKER_MAGIC)
+	{
+		printv(1, "era: no clean shutdown marker\n");
+		return 0;
+	}
+
+	if (le64toh(marker->md_blocks) != md->blocks ||
+	    le32toh(marker->digest) != clean_digest(sb) ||
+	    sb->metadata_snap)
+	{
+		printv(1, "era: stale clean shutdown marker\n");
+		return 0;
+	}
+
+	// marker is for one open only
+	memset(marker, 0, sizeof(*marker));
+
+	csum = (struct md_csum) { sb, SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
+
+	if (md_write(md, 0, sb) || md_sync(md))
+		return -1;
+
+	return 1;
+}
+
+/*
+ * metadata id
+ */
+
+// give metadata random id, if it has none
+int era_metadata_set_id(struct md *md)
+{
+	struct era_metadata_id *id;
+	struct era_superblock *sb;
+	struct md_csum csum;
+
+	sb = md_block(md, 0, 0, SUPERBLOCK_CSUM_XOR);
+	if (!sb || era_sb_check(sb))
+		return -1;
+
+	if (era_metadata_id(sb))
+		return 0;
+
+	id = (void *)sb + METADATA_ID_OFFSET;
+	id->magic = htole64(METADATA_ID_MAGIC);
+
+	if (random_uuid(id->uuid))
+		return -1;
+
+	printv(1, "era: metadata id %s\n", uuid2str(id->uuid));
+
+	csum = (struct md_csum) { sb, SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
+
+	return md_write(md, 0, sb);
+}
+
+// metadata id of superblock block, NULL if it has none
+const void *era_metadata_id(struct era_superblock *sb)
+{
+	struct era_metadata_id *id = (void *)sb + METADATA_ID_OFFSET;
+
+	if (le64toh(id->magic) != METADATA_ID_MAGIC)
+		return NULL;
+
+	return id->uuid;
+}
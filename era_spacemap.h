@@ -40,6 +40,49 @@ struct disk_bitmap_header {
 #define BYTES_PER_BLOCK (MD_BLOCK_SIZE - sizeof(struct disk_bitmap_header))
 #define ENTRIES_PER_BLOCK (BYTES_PER_BLOCK * ENTRIES_PER_BYTE)
 
+/*
+ * kernel metadata space map has exactly one index block,
+ * blocks past this limit are never allocated by the kernel
+ * (DM_SM_METADATA_MAX_BLOCKS)
+ */
+#define MAX_METADATA_BLOCKS \
+	((uint64_t)MAX_METADATA_BITMAPS * ENTRIES_PER_BLOCK)
+
+/*
+ * clean shutdown marker at the end of superblock block: digest
+ * of superblock fields and metadata size at close, any change
+ * by the kernel or of the device makes it stale
+ */
+#define CLEAN_MARKER_MAGIC 0x6e61656c632d6165ULL
+
+struct era_clean_marker {
+	__le64 magic;
+	__le64 md_blocks;
+	__le32 digest;
+} __attribute__ ((packed));
+
+#define CLEAN_MARKER_OFFSET \
+	(MD_BLOCK_SIZE - sizeof(struct era_clean_marker))
+
+/*
+ * metadata id below clean shutdown marker: kernel zeroes uuid
+ * of superblock on every commit, but keeps the rest of the
+ * block, and metadata snapshot gets a copy of the whole block
+ */
+#define METADATA_ID_MAGIC 0x646974656d2d6165ULL
+
+struct era_metadata_id {
+	__le64 magic;
+	__u8 uuid[UUID_LEN];
+} __attribute__ ((packed));
+
+#define METADATA_ID_OFFSET \
+	(CLEAN_MARKER_OFFSET - sizeof(struct era_metadata_id))
+
 int era_spacemap_rebuild(struct md *md);
+int era_spacemap_mark_clean(struct md *md);
+int era_spacemap_clean(struct md *md);
+int era_metadata_set_id(struct md *md);
+const void *era_metadata_id(struct era_superblock *sb);
 
 #endif
@@ -5,6 +5,7 @@
 #define _GNU_SOURCE
 
 #include <sys/mman.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -12,6 +13,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "era.h"
 #include "era_md.h"
@@ -30,28 +33,37 @@ void *empty_block;
 // options
 int verbose = 0;
 int force = 0;
+int jobs = 0;
+int max_suspend_ms = 0;
+int stats = 0;
+int verify_leaves = 0;
 
 // getopt_long
-static char *short_options = "hvf";
+static char *short_options = "hvfj:";
 static struct option long_options[] = {
-	{ "help",    no_argument, NULL, 'h' },
-	{ "verbose", no_argument, NULL, 'v' },
-	{ "force",   no_argument, NULL, 'f' },
-	{ NULL,      0,           NULL, 0   }
+	{ "help",           no_argument,       NULL, 'h' },
+	{ "verbose",        no_argument,       NULL, 'v' },
+	{ "force",          no_argument,       NULL, 'f' },
+	{ "jobs",           required_argument, NULL, 'j' },
+	{ "max-suspend-ms", required_argument, NULL, 'S' },
+	{ "stats",          required_argument, NULL, 's' },
+	{ "verify-leaves",  no_argument,       NULL, 'V' },
+	{ NULL,             0,                 NULL, 0   }
 };
 
 // print usage and exit
 void usage(FILE *out, int code)
 {
 	fprintf(out, "Usage:\n\n"
-	"erasetup [-h|--help] [-v|--verbose] [-f|--force]\n"
+	"erasetup [-h|--help] [-v|--verbose] [-f|--force] [-j|--jobs N]\n"
+	"         [--max-suspend-ms MS] [--stats=json] [--verify-leaves]\n"
 	"         <command> [command options]\n\n"
 	"         create <name> <metadata-dev> <data-dev> [chunk-size]\n"
 	"         open <name> <metadata-dev> <data-dev>\n"
 	"         close <name>\n"
 	"         status [name]\n"
 	"         dumpmeta <metadata-dev>\n\n"
-	"         takesnap <name> <snapshot-dev>\n"
+	"         takesnap <name> <snapshot-dev> [<name> <snapshot-dev> ...]\n"
 	"         dropsnap <snapshot-dev>\n"
 	"         dumpsnap <metadata-dev>\n"
 	"\n");
@@ -61,6 +73,7 @@ void usage(FILE *out, int code)
 // custom error print function
 void error(int err, const char *fmt, ...)
 {
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	static size_t bufsize = 0;
 	static char *buffer, *p;
 	va_list ap;
@@ -72,11 +85,14 @@ void error(int err, const char *fmt, ...)
 		return;
 	}
 
+	// may be called from parallel walk threads
+	pthread_mutex_lock(&lock);
+
 	if (bufsize == 0)
 	{
 		buffer = malloc(512);
 		if (!buffer)
-			return;
+			goto out;
 		bufsize = 512;
 	}
 
@@ -87,7 +103,7 @@ void error(int err, const char *fmt, ...)
 		va_end(ap);
 
 		if (n < 0)
-			return;
+			goto out;
 
 		if (n < bufsize)
 			break;
@@ -102,7 +118,7 @@ void error(int err, const char *fmt, ...)
 		{
 			free(buffer);
 			bufsize = 0;
-			return;
+			goto out;
 		}
 	}
 
@@ -110,6 +126,18 @@ void error(int err, const char *fmt, ...)
 		fprintf(stderr, "%s\n", buffer);
 	else
 		fprintf(stderr, "%s: %s\n", buffer, strerror(err));
+out:
+	pthread_mutex_unlock(&lock);
+}
+
+// monotonic clock in milliseconds
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 }
 
 // convert uuid to string
@@ -134,6 +162,30 @@ char *uuid2str(const void *uuid)
 	return buffer;
 }
 
+// fill uuid with random bytes
+int random_uuid(void *uuid)
+{
+	int fd;
+
+	fd = open(RANDOM_DEVICE, O_RDONLY);
+	if (fd == -1)
+	{
+		error(errno, "can't open %s", RANDOM_DEVICE);
+		return -1;
+	}
+
+	if (read(fd, uuid, UUID_LEN) != UUID_LEN)
+	{
+		error(errno, "can't read %s", RANDOM_DEVICE);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
 // check era superblock
 int era_sb_check(struct era_superblock *sb)
 {
@@ -177,6 +229,35 @@ int main(int argc, char **argv)
 		case 'f':
 			force++;
 			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+			{
+				error(0, "invalid number of jobs: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'S':
+			max_suspend_ms = atoi(optarg);
+			if (max_suspend_ms < 1)
+			{
+				error(0, "invalid suspend time limit: %s",
+				      optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			if (strcmp(optarg, "json"))
+			{
+				error(0, "unsupported stats format: %s",
+				      optarg);
+				return 1;
+			}
+			stats = STATS_JSON;
+			break;
+		case 'V':
+			verify_leaves++;
+			break;
 		case 'h':
 			usage(stdout, 0);
 		case '?':
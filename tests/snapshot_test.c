@@ -0,0 +1,500 @@
+/*
+ * This file is released under the GPL.
+ *
+ * incremental snapshot copy test: previous snapshot is used
+ * only when it is of the same era metadata (metadata id), the
+ * superblock uuid is zeroed by the kernel on every commit and
+ * has to play no part
+ *
+ * make check
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "../era.h"
+#include "../era_md.h"
+#include "../bitmap.h"
+#include "../era_blk.h"
+#include "../era_btree.h"
+#include "../era_spacemap.h"
+#include "../era_snapshot.h"
+
+// chunks of the era device
+#define TEST_CHUNKS 256
+
+// blocks of metadata and snapshot files
+#define TEST_BLOCKS 64
+
+// era of the writeset and of the previous snapshot
+#define TEST_WRITESET_ERA 3
+
+// chunks written in writeset era
+#define TEST_WRITTEN 8
+
+/*
+ * erasetup.c and era_blk.c: metadata and snapshots are
+ * regular files here
+ */
+
+void *empty_block;
+int verbose;
+int force;
+int jobs = 1;
+int max_suspend_ms;
+int stats;
+int verify_leaves;
+
+void error(int err, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (fmt)
+	{
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+
+	if (err)
+		fprintf(stderr, "%s%s", fmt ? ": " : "", strerror(err));
+
+	fprintf(stderr, "\n");
+}
+
+char *uuid2str(const void *uuid)
+{
+	static char buffer[UUID_LEN * 2 + 1];
+	const unsigned char *u = uuid;
+	unsigned i;
+
+	for (i = 0; i < UUID_LEN; i++)
+		sprintf(buffer + i * 2, "%02x", u[i]);
+
+	return buffer;
+}
+
+int random_uuid(void *uuid)
+{
+	static unsigned char next;
+	unsigned char *u = uuid;
+	unsigned i;
+
+	// different ids are enough
+	next++;
+	for (i = 0; i < UUID_LEN; i++)
+		u[i] = next + i;
+
+	return 0;
+}
+
+int era_sb_check(struct era_superblock *sb)
+{
+	if (le64toh(sb->magic) != SUPERBLOCK_MAGIC)
+	{
+		error(0, "bad era superblock magic");
+		return -1;
+	}
+
+	return 0;
+}
+
+int blkopen(const char *device, int rw,
+            unsigned *major, unsigned *minor, uint64_t *sectors)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(device, rw ? O_RDWR : O_RDONLY);
+	if (fd == -1 || fstat(fd, &st))
+	{
+		error(errno, "can't open %s", device);
+		return -1;
+	}
+
+	*major = 0;
+	*minor = 0;
+	*sectors = st.st_size >> SECTOR_SHIFT;
+
+	return fd;
+}
+
+int blkopen2(unsigned major, unsigned minor, int rw, uint64_t *sectors)
+{
+	return -1;
+}
+
+int blkrotational(unsigned major, unsigned minor)
+{
+	return 0;
+}
+
+/*
+ * metadata: era array of one array block, all chunks in era 1,
+ * writeset of TEST_WRITESET_ERA with first TEST_WRITTEN chunks
+ */
+
+enum {
+	BLOCK_SUPERBLOCK,
+	BLOCK_ARRAY_TREE,
+	BLOCK_ARRAY,
+	BLOCK_WRITESET_TREE,
+	BLOCK_BITSET_TREE,
+	BLOCK_BITSET
+};
+
+static char test_dir[] = "/tmp/era-test-XXXXXX";
+static char *block;
+
+static int put_block(int fd, uint64_t nr, uint32_t xor)
+{
+	struct md_csum csum = { block, xor };
+
+	md_csum_seal_many(&csum, 1);
+
+	if (pwrite(fd, block, MD_BLOCK_SIZE, nr * MD_BLOCK_SIZE) !=
+	    MD_BLOCK_SIZE)
+	{
+		error(errno, "can't write block %llu",
+		      (long long unsigned)nr);
+		return -1;
+	}
+
+	return 0;
+}
+
+// btree leaf with one entry, max_entries as kernel sets
+static int put_leaf(int fd, uint64_t nr, uint64_t key,
+                    const void *value, unsigned value_size)
+{
+	struct btree_node *node = (void *)block;
+	unsigned max_entries;
+
+	max_entries = (MD_BLOCK_SIZE - sizeof(struct node_header)) /
+	              (sizeof(uint64_t) + value_size);
+	max_entries -= max_entries % 3;
+
+	memset(block, 0, MD_BLOCK_SIZE);
+	node->header.flags = htole32(LEAF_NODE);
+	node->header.blocknr = htole64(nr);
+	node->header.nr_entries = htole32(1);
+	node->header.max_entries = htole32(max_entries);
+	node->header.value_size = htole32(value_size);
+	node->keys[0] = htole64(key);
+	memcpy(&node->keys[max_entries], value, value_size);
+
+	return put_block(fd, nr, BTREE_CSUM_XOR);
+}
+
+static int put_array(int fd, uint64_t nr, const void *values,
+                     unsigned count, unsigned value_size)
+{
+	struct array_node *node = (void *)block;
+
+	memset(block, 0, MD_BLOCK_SIZE);
+	node->header.max_entries = htole32(ARRAY_ENTRIES(value_size));
+	node->header.nr_entries = htole32(count);
+	node->header.value_size = htole32(value_size);
+	node->header.blocknr = htole64(nr);
+	memcpy(node->values, values, count * value_size);
+
+	return put_block(fd, nr, ARRAY_CSUM_XOR);
+}
+
+// era_array with all chunks in era
+static int put_eras(int fd, uint32_t era)
+{
+	__le32 eras[TEST_CHUNKS];
+	unsigned i;
+
+	for (i = 0; i < TEST_CHUNKS; i++)
+		eras[i] = htole32(era);
+
+	return put_array(fd, BLOCK_ARRAY, eras, TEST_CHUNKS,
+	                 sizeof(eras[0]));
+}
+
+static int create_metadata(const char *path)
+{
+	struct era_superblock *sb = (void *)block;
+	struct era_writeset ws;
+	__le64 words[TEST_CHUNKS / 64] = { 0 };
+	__le64 value;
+	int fd, rc = -1;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || ftruncate(fd, TEST_BLOCKS * MD_BLOCK_SIZE))
+	{
+		error(errno, "can't create %s", path);
+		goto out;
+	}
+
+	value = htole64(BLOCK_ARRAY);
+	if (put_leaf(fd, BLOCK_ARRAY_TREE, 0, &value, sizeof(value)) ||
+	    put_eras(fd, 1))
+		goto out;
+
+	ws.nr_bits = htole32(TEST_CHUNKS);
+	ws.root = htole64(BLOCK_BITSET_TREE);
+	value = htole64(BLOCK_BITSET);
+	words[0] = htole64((1ULL << TEST_WRITTEN) - 1);
+
+	if (put_leaf(fd, BLOCK_WRITESET_TREE, TEST_WRITESET_ERA,
+	             &ws, sizeof(ws)) ||
+	    put_leaf(fd, BLOCK_BITSET_TREE, 0, &value, sizeof(value)) ||
+	    put_array(fd, BLOCK_BITSET, words, TEST_CHUNKS / 64,
+	              sizeof(words[0])))
+		goto out;
+
+	// uuid left zero, as the kernel leaves it after commit
+	memset(block, 0, MD_BLOCK_SIZE);
+	sb->magic = htole64(SUPERBLOCK_MAGIC);
+	sb->version = htole32(MAX_ERA_VERSION);
+	sb->data_block_size = htole32(128);
+	sb->metadata_block_size = htole32(MD_BLOCK_SIZE >> SECTOR_SHIFT);
+	sb->nr_blocks = htole32(TEST_CHUNKS);
+	sb->current_era = htole32(TEST_WRITESET_ERA + 2);
+	sb->writeset_tree_root = htole64(BLOCK_WRITESET_TREE);
+	sb->era_array_root = htole64(BLOCK_ARRAY_TREE);
+
+	if (put_block(fd, BLOCK_SUPERBLOCK, SUPERBLOCK_CSUM_XOR))
+		goto out;
+
+	rc = 0;
+out:
+	if (fd != -1)
+		close(fd);
+	return rc;
+}
+
+// change era_array behind metadata id, as only a snapshot can see
+static int set_eras(const char *path, uint32_t era)
+{
+	int fd, rc;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		error(errno, "can't open %s", path);
+		return -1;
+	}
+
+	rc = put_eras(fd, era);
+	close(fd);
+	return rc;
+}
+
+// give metadata new id, as recreated metadata would get on open
+static int new_metadata_id(const char *path)
+{
+	struct md_csum csum;
+	struct md *md;
+	int rc;
+
+	md = md_open(path, 1);
+	if (!md)
+		return -1;
+
+	if (md_read(md, BLOCK_SUPERBLOCK, block))
+	{
+		md_close(md);
+		return -1;
+	}
+
+	memset(block + METADATA_ID_OFFSET, 0,
+	       sizeof(struct era_metadata_id));
+
+	csum = (struct md_csum) { block, SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
+
+	rc = md_write(md, BLOCK_SUPERBLOCK, block) ||
+	     md_sync(md) || era_metadata_set_id(md) || md_sync(md);
+
+	return md_close(md) || rc ? -1 : 0;
+}
+
+/*
+ * copy snapshot of metadata, from prev if given, and write its
+ * superblock as takesnap does
+ */
+static int take_snapshot(const char *path, const char *snap_path,
+                         const char *prev_path)
+{
+	struct era_snapshot_superblock *ssb = (void *)block;
+	struct md *md, *sn, *prev = NULL;
+	unsigned nr_extents, extent_blocks;
+	unsigned char id[UUID_LEN];
+	unsigned long *bitmap;
+	struct md_csum csum;
+	int fd, rc = -1;
+
+	fd = open(snap_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1 || ftruncate(fd, TEST_BLOCKS * MD_BLOCK_SIZE))
+	{
+		error(errno, "can't create %s", snap_path);
+		return -1;
+	}
+	close(fd);
+
+	md = md_open(path, 0);
+	sn = md_open(snap_path, 1);
+	if (prev_path)
+		prev = md_open(prev_path, 0);
+
+	bitmap = calloc(LONGS(TEST_CHUNKS), sizeof(long));
+
+	if (!md || !sn || (prev_path && !prev) || !bitmap)
+		goto out;
+
+	if (era_snapshot_copy(md, sn, prev, BLOCK_SUPERBLOCK, TEST_CHUNKS,
+	                      &nr_extents, &extent_blocks, id) ||
+	    era_snapshot_digest(sn, 1 + extent_blocks, bitmap, TEST_CHUNKS))
+		goto out;
+
+	memset(block, 0, MD_BLOCK_SIZE);
+	ssb->magic = htole64(SNAP_SUPERBLOCK_MAGIC);
+	ssb->version = htole32(SNAP_VERSION);
+	ssb->era_size = htole64(TEST_CHUNKS);
+	ssb->data_block_size = htole32(128);
+	ssb->metadata_block_size = htole32(MD_BLOCK_SIZE >> SECTOR_SHIFT);
+	ssb->nr_blocks = htole32(TEST_CHUNKS);
+	ssb->snapshot_era = htole32(TEST_WRITESET_ERA);
+	ssb->nr_extents = htole32(nr_extents);
+	ssb->extent_blocks = htole32(extent_blocks);
+	ssb->bitmap_blocks = htole32(SNAP_BITMAP_BLOCKS(TEST_CHUNKS));
+	memcpy(ssb->metadata_id, id, UUID_LEN);
+
+	csum = (struct md_csum) { ssb, SNAP_SUPERBLOCK_CSUM_XOR };
+	md_csum_seal_many(&csum, 1);
+
+	if (md_write(sn, 0, ssb) || md_sync(sn))
+		goto out;
+
+	rc = 0;
+out:
+	free(bitmap);
+	if (prev)
+		md_close(prev);
+	if (sn && md_close(sn))
+		rc = -1;
+	if (md)
+		md_close(md);
+	return rc;
+}
+
+/*
+ * check eras of snapshot: written chunks are in writeset era,
+ * the rest in era of unwritten
+ */
+static int check_snapshot(const char *snap_path, uint32_t unwritten)
+{
+	struct era_snapshot_reader *r;
+	uint32_t eras[TEST_CHUNKS];
+	struct md *sn;
+	unsigned i;
+	int rc = -1;
+
+	sn = md_open(snap_path, 0);
+	if (!sn)
+		return -1;
+
+	r = era_snapshot_open(sn);
+	if (!r)
+		goto out;
+
+	if (era_snapshot_read(r, 0, TEST_CHUNKS, eras))
+		goto out_close;
+
+	for (i = 0; i < TEST_CHUNKS; i++)
+	{
+		uint32_t expected = i < TEST_WRITTEN ?
+		                    TEST_WRITESET_ERA : unwritten;
+
+		if (eras[i] != expected)
+		{
+			error(0, "%s: chunk %u: expected era %u, but got %u",
+			      snap_path, i, expected, eras[i]);
+			goto out_close;
+		}
+	}
+
+	rc = 0;
+out_close:
+	era_snapshot_close(r);
+out:
+	md_close(sn);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	char meta[64], snap1[64], snap2[64], snap3[64];
+	int rc = 1;
+
+	empty_block = mmap(NULL, MD_BLOCK_SIZE, PROT_READ,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	block = mmap(NULL, MD_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (empty_block == MAP_FAILED || block == MAP_FAILED ||
+	    !mkdtemp(test_dir))
+	{
+		error(errno, "can't set up test");
+		return 1;
+	}
+
+	snprintf(meta, sizeof(meta), "%s/meta", test_dir);
+	snprintf(snap1, sizeof(snap1), "%s/snap1", test_dir);
+	snprintf(snap2, sizeof(snap2), "%s/snap2", test_dir);
+	snprintf(snap3, sizeof(snap3), "%s/snap3", test_dir);
+
+	if (create_metadata(meta) || new_metadata_id(meta))
+		goto out;
+
+	// full copy: no previous snapshot
+	if (take_snapshot(meta, snap1, NULL) || check_snapshot(snap1, 1))
+		goto out;
+
+	/*
+	 * era_array changes, but eras of unwritten chunks must come
+	 * from the previous snapshot of the same metadata
+	 */
+
+	if (set_eras(meta, 2))
+		goto out;
+
+	if (take_snapshot(meta, snap2, snap1) || check_snapshot(snap2, 1))
+	{
+		error(0, "incremental copy not done");
+		goto out;
+	}
+
+	printf("incremental copy: ok\n");
+
+	// recreated metadata: previous snapshot is not of it
+	if (new_metadata_id(meta) ||
+	    take_snapshot(meta, snap3, snap1) || check_snapshot(snap3, 2))
+	{
+		error(0, "full copy not done");
+		goto out;
+	}
+
+	printf("full copy of other metadata: ok\n");
+
+	rc = 0;
+out:
+	unlink(meta);
+	unlink(snap1);
+	unlink(snap2);
+	unlink(snap3);
+	rmdir(test_dir);
+	return rc;
+}